@@ -8,10 +8,23 @@
 //   Last Modified : FRI APRIL 17 2020
 //
 
-// Includes 
+// Includes
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <cmpsc311_log.h>
 #include <lcloud_cache.h>
 #include <lcloud_support.h>
@@ -21,120 +34,4024 @@
 // Functions
 
 
-//Struct to keep track of each value in the cache line
+//Links for the doubly linked lists that cache lines and ghost entries sit on
+typedef struct {
+    int prev;
+    int next;
+}cachelink;
+
+//Head, tail and length of one of the replacement lists
+typedef struct {
+    int head;
+    int tail;
+    int size;
+}cachelist;
+
+//Struct to keep track of each cache line, the block itself is in the shard's part of the data slab
 typedef struct {
     int devid;
     int sector;
     int block;
+    uint64_t key;
+    int hashnext;
+    cachelink link;
+    int list;
+    int ref;
+    int freq;
+    int heappos;
+    uint64_t stamp;
+    int pins;
+    int loading;
+    int dirty;
+    int prefetched;
+    int part;
+    int file;
+}cache;
+
+//Struct to remember the key of a recently evicted block (used by ARC and 2Q)
+typedef struct {
+    uint64_t key;
+    int hashnext;
+    cachelink link;
+    int list;
+}ghost;
+
+//Struct for a key sampled by the miss ratio curve estimator, with the access time of its last use
+typedef struct {
+    uint64_t key;
+    int hashnext;
+    cachelink link;
     int time;
+}mrcsample;
+
+//Struct for a block in the compressed tier, its data malloced at the compressed length
+typedef struct {
+    uint64_t key;
+    int hashnext;
+    cachelink link;
+    int len;
+    unsigned char *data;
+}zentry;
+
+//Struct for a block in the disk tier, its data is in the shard's slot of the mapped file
+typedef struct {
+    uint64_t key;
+    int hashnext;
+    cachelink link;
+}l2entry;
+
+//The replacement lists, lines and ghosts share one index space (ghost g is node maxsize+g,
+// MRC sample m is node 2*maxsize+m, compressed entry z is node 2*maxsize+mrcsize+z and disk
+// tier entry e is node 2*maxsize+mrcsize+zsize+e)
+// LRU uses list 0, 2Q uses A1in/Am/A1out and ARC uses T1/T2/B1/B2
+#define LC_LIST_T1 0
+#define LC_LIST_T2 1
+#define LC_LIST_B1 2
+#define LC_LIST_B2 3
+#define LC_LIST_COUNT 4
+
+//Ways in a set of the line index, and the tags marking a never used or deleted way, a way whose
+// line a rebuild has yet to put back, and the unused tag bytes (the tag of a line is 7 bits of
+// its key hash)
+#define LC_SET_WAYS 12
+#define LC_TAG_EMPTY 0x80
+#define LC_TAG_PENDING 0x81
+#define LC_TAG_DELETED 0xFE
+#define LC_TAG_PAD 0xFF
+
+//Sampled keys the miss ratio curve estimator keeps over all shards, and the number of
+// histogram slots (a quarter of the cache each, so out to 64 times the cache size)
+#define LC_MRC_SAMPLES 8192
+#define LC_MRC_BUCKETS 256
+#define LC_MRC_MAXMULTIPLE 64
+
+//TinyLFU admission sketch: rows of the count-min sketch, counters a row gets per line of the shard,
+// the 4 bit counter limit, and how many accesses (in lines of the shard) before every counter is halved
+#define LC_SKETCH_ROWS 4
+#define LC_SKETCH_WIDTH 4
+#define LC_SKETCH_MAXCOUNT 15
+#define LC_SKETCH_PERIOD 10
+
+//Lines each shard keeps outside the index for misses the admission filter turns away, and the
+// lcloud_takeline results for a turned away block and for a look again after a victim was written back
+#define LC_BYPASS_LINES 4
+#define LC_LINE_REJECTED -2
+#define LC_LINE_RETRY -3
+
+//Mask of every partition, for evictions that may take any line
+#define LC_PART_ALL ((1u << LC_CACHE_MAXPARTS) - 1)
+
+//Each thread times one lookup in this many for the latency histogram, reading the clock twice
+//on every lookup would cost more than a cache hit does
+#define LC_LATENCY_SAMPLE 64
+
+//Snapshot file header magic ("LCCS") and format version, and the FNV-1a hash its checksum is
+#define LC_SNAPSHOT_MAGIC 0x5343434C
+#define LC_SNAPSHOT_VERSION 2
+#define LC_FNV_OFFSET 0xCBF29CE484222325ULL
+#define LC_FNV_PRIME 0x100000001B3ULL
+
+//Compressed block formats: raw bytes, 7 bits a byte, or printable text three characters to 20 bits,
+// each after a three byte header of the format and the length without trailing zeros
+#define LC_ZCODEC_RAW 0
+#define LC_ZCODEC_7BIT 1
+#define LC_ZCODEC_TEXT 2
+#define LC_ZCODEC_HEADER 3
+#define LC_ZCODEC_MAXLEN (LC_ZCODEC_HEADER + 256)
+
+//Huge page size the cache arena is aligned to and sized in
+#define LC_HUGE_PAGE (2 * 1024 * 1024)
+
+//Shared memory tier header magic ("LCSM") and layout version, ways in each of its sets, times a
+// reader tries a slot a writer is in before calling it a miss, and the suffix of the object whose
+// lock opens and closes of the tier take turns on
+#define LC_SHM_MAGIC 0x4D53434C
+#define LC_SHM_VERSION 3
+#define LC_SHM_WAYS 8
+#define LC_SHM_RETRIES 16
+#define LC_SHM_GUARD ".lock"
+
+//Slot of the shared memory tier (key is the packed key plus one, 0 when empty). Readers take no
+// lock, they copy the slot and keep the copy only if seq was even (no writer in it) and the same
+// before and after
+typedef struct {
+    uint32_t seq;
+    uint32_t ref;
+    uint64_t key;
     char data[256];
+}shmslot;
+
+//Set of the shared memory tier, writers in any process take its lock to change a slot and evict
+// with a CLOCK hand over the ways. The lock is a robust process-shared mutex, so a process that
+// dies holding it hands it to the next taker instead of leaving every other process stuck.
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t hand;
+    shmslot slots[LC_SHM_WAYS];
+}shmset;
+
+//Header at the front of the shared memory segment, followed by its sets. Each process using the
+// segment holds a shared flock on it (dropped by the kernel however the process ends), so the
+// segment is in use exactly while someone holds one.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sets;
+    uint32_t pad;
+}shmheader;
+
+//Struct for a set of the line index, sized to one 64 byte cache line: a tag for each way
+// (padded to 16 so they load and compare as one vector) and the line index in each way
+typedef struct {
+    uint8_t tags[16];
+    int lines[LC_SET_WAYS];
+}lineset;
+
+//One shard of the cache, blocks are spread over the shards by key and each shard has its
+// own lock, lines, hash index and replacement state so threads on different shards never meet
+typedef struct {
+    pthread_mutex_t lock;
+    //Signalled when a load the shard was unlocked for finishes (threads that missed on the same
+    // block wait on it instead of reading the device again)
+    pthread_cond_t loaded;
+
+    //Array of cache lines, and the size and capacity (in blocks) of the shard
+    cache *lrucache;
+    int currentsize;
+    int maxsize;
+    //Lines given back after a failed load or a drop, threaded through hashnext (-1 if none)
+    int linefree;
+    //The blocks of the lines, 256 bytes each from line slabbase of the data slab
+    char *blocks;
+    int slabbase;
+
+    //Set associative index over the cache lines, each set holds LC_SET_WAYS lines with a one byte
+    // tag from the key hash (compared all at once), probing on to the next set until one with an
+    // empty way, with the count of deleted ways left as tombstones
+    lineset *sets;
+    int setbits;
+    int settombs;
+    //log2 of the number of ghost hash buckets
+    int hashbits;
+
+    //Ghost entries for evicted keys, with their own hash index and a free list threaded through link.next
+    ghost *ghosts;
+    int *ghostbuckets;
+    int ghostfree;
+
+    //The replacement lists
+    cachelist lists[LC_LIST_COUNT];
+
+    //CLOCK hand position
+    int clockhand;
+
+    //LFU min heap of line indexes ordered by (freq, stamp), and the access counter used as stamp
+    // (every policy stamps lines so the snapshot can keep their recency)
+    int *lfuheap;
+    int lfuheapsize;
+    uint64_t accesscount;
+
+    //ARC target size of T1
+    int arctarget;
+
+    //Event counters for the whole shard and by device and file (the file that filled a line is
+    // charged for its eviction and flush), and the lookup latency histogram
+    LcCacheCounters total;
+    LcCacheCounters devstats[LC_CACHE_STATDEVICES];
+    LcCacheCounters *filestats;
+    uint64_t latency[LC_CACHE_LATBUCKETS];
+    //Blocks put in by readahead, how many were used and how many were evicted without being used
+    int prefetches, prefetchhits, prefetchwasted;
+    //Misses that waited for another thread's load of the block instead of reading it again
+    int coalesced;
+
+    //Lines held by each partition, its hits and misses, and the partitions the policy may take a
+    // victim from on this eviction
+    int partsize[LC_CACHE_MAXPARTS];
+    int parthits[LC_CACHE_MAXPARTS];
+    int partmisses[LC_CACHE_MAXPARTS];
+    unsigned evictmask;
+
+    //TinyLFU admission: a count-min sketch (LC_SKETCH_ROWS rows of 1 << sketchbits counters) of
+    // how often keys were used lately, halved every sketchperiod accesses, and how many new blocks
+    // it let in or turned away. Misses turned away are read into the bypass lines (past the end of
+    // the slab lines) so the caller still gets a pinned block, with the key (plus one) each was
+    // loaded for and whether the load is still going
+    uint8_t *sketch;
+    int sketchbits;
+    int sketchadds;
+    int sketchperiod;
+    int admitted, rejected;
+    char *bypass;
+    int bypasspins[LC_BYPASS_LINES];
+    uint64_t bypasskeys[LC_BYPASS_LINES];
+    int bypassloading[LC_BYPASS_LINES];
+
+    //Miss ratio curve estimate (SHARDS): keys whose hash falls under mrcthreshold are sampled and
+    // kept on a recency list with their own hash index, a Fenwick tree over access times counts the
+    // distinct sampled keys between two uses of a key, and the reuse distances scaled up by the
+    // sampling rate go in a histogram (the last slot counts first uses and forgotten keys)
+    mrcsample *mrcsamples;
+    int *mrcbuckets;
+    int mrcbits;
+    int mrcfree;
+    int mrcsize;
+    cachelist mrclist;
+    int *mrctree;
+    int mrctreesize;
+    int mrctime;
+    uint32_t mrcthreshold;
+    double mrcscale;
+    int mrcaccesses;
+    int mrchist[LC_MRC_BUCKETS + 1];
+
+    //Compressed tier: clean blocks evicted from the lines are compressed and kept on an LRU list
+    // with their own hash index, up to zmaxbytes counting the entry overhead, a hit decompresses
+    // the block back into a line
+    zentry *zentries;
+    int *zbuckets;
+    int zbits;
+    int zfree;
+    int zsize;
+    cachelist zlist;
+    int zbytes, zmaxbytes;
+    int zhits, zstored, zevicted, zinbytes;
+
+    //Disk tier: clean blocks evicted from the lines are also copied to the shard's l2size slots of
+    // the memory mapped file (slot e at l2data + 256*e), kept on an LRU list with their own hash
+    // index, a hit copies the block back into a line
+    l2entry *l2entries;
+    int *l2buckets;
+    int l2bits;
+    int l2free;
+    int l2size;
+    cachelist l2list;
+    char *l2data;
+    int l2hits, l2stored, l2evicted;
+
+    //Blocks brought up from and published to the shared memory tier (which is not split by shard)
+    int shmhits, shmstored;
+}cacheshard;
+
+//Header at the front of a cache snapshot file, followed by the devices the blocks came from and
+// count key/data records from coldest to hottest. The checksum covers the devices and records.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blocksize;
+    uint32_t count;
+    uint32_t devices;
+    uint32_t pad;
+    uint64_t checksum;
+}snapshotheader;
+
+//A line gathered for the snapshot, sorted by the time of its last use
+typedef struct {
+    uint64_t stamp;
+    uint64_t key;
+    char *data;
+}snapshotline;
+
+//Replacement policy, the engine calls these on every hit, insert and eviction
+typedef struct {
+    const char *name;
+    void (*hit)( cacheshard *s, int line );
+        // A cached line was read or overwritten
+    int (*victim)( cacheshard *s, int ghostlist );
+        // Pick a line to evict and take it off the policy structures (ghosts are only made once
+        // evicted is called, so a block the admission filter turns away leaves them as they were)
+    void (*insert)( cacheshard *s, int line, int ghostlist );
+        // A new block was put in the line (ghostlist is the ghost list its key was dropped from, -1 if none)
+    void (*remove)( cacheshard *s, int line );
+        // The line is being dropped from the cache, take it off the policy structures
+    void (*restore)( cacheshard *s, int line );
+        // Put back the line victim just took, the admission filter kept it over the new block
+    void (*evicted)( cacheshard *s, int line );
+        // The line victim took is really being evicted, remember its key if the policy keeps ghosts
+}cachepolicy;
+
+//The shards, allocated by lcloud_initcache, and log2 of their number
+static cacheshard *shards = NULL;
+static int shardcount;
+static int shardbits;
+//The data slab holding every line's block, split over the shards in order
+static char *cacheslab = NULL;
+//The arena (NULL if the cache is on the heap), its size, how much is handed out and what backs it
+static char *cachearena = NULL;
+static size_t arenabytes = 0;
+static size_t arenaused = 0;
+static LcCacheArena arenakind = LC_CACHE_HEAP;
+//Total cache size, the admission bypass lines after it in the slab, and the width (in blocks)
+// of a miss ratio curve histogram slot
+static int cacheblocks;
+static int bypassblocks;
+static int mrcwidth;
+
+//Number of blocks lcopen sizes the cache to, settable before the first open
+int lcloud_cacheblocks = LC_CACHE_MAXBLOCKS;
+//Number of shards lcloud_initcache splits the cache into, settable before the first open
+int lcloud_cacheshards = 1;
+//Replacement policy lcloud_initcache sets up, settable before the first open
+LcCachePolicy lcloud_cachepolicy = LC_CACHE_LRU;
+//Write-back mode, when set lcloud_writecache holds writes as dirty lines instead of writing through
+int lcloud_cachewriteback = 0;
+//Bytes of memory for the compressed tier below the cache lines, 0 for none
+int lcloud_cachezbytes = 0;
+//File the cache contents are saved to at close and reloaded from at init, NULL for none
+char *lcloud_cachesnapshot = NULL;
+//TinyLFU admission, when set a new block only evicts a line if it was used more often lately
+int lcloud_cacheadmission = 0;
+//Local file backing the disk tier below the cache lines (NULL for none) and its size in blocks
+char *lcloud_cachel2file = NULL;
+int lcloud_cachel2blocks = LC_CACHE_L2BLOCKS;
+//The disk tier file mapped into memory, split over the shards in order
+static char *l2map = NULL;
+static size_t l2mapbytes = 0;
+//POSIX shared memory object for the tier co-located processes share (NULL for none) and the
+// size in blocks a process creating it gives it
+char *lcloud_cacheshmname = NULL;
+int lcloud_cacheshmblocks = LC_CACHE_SHMBLOCKS;
+//Allocate the slab and line metadata from a huge page arena (caches of a huge page or more) when set
+int lcloud_cachehugepages = 1;
+//The shared memory segment mapped into memory (and its descriptor, holding the flock, and the
+// process that opened it, a child forked after does not own the flock), its sets and the set
+// count less one
+static shmheader *shmmap = NULL;
+static size_t shmmapbytes = 0;
+static int shmfd = -1;
+static pid_t shmpid = 0;
+static shmset *shmsets = NULL;
+static uint32_t shmmask = 0;
+//Partition quotas (in blocks over the whole cache, a max of 0 is no limit), the partition of
+// each device, and whether any quota was set
+static int partmin[LC_CACHE_MAXPARTS];
+static int partmax[LC_CACHE_MAXPARTS];
+static uint8_t devpart[256];
+static int partitioned = 0;
+//Partition the calling thread's blocks go in, -1 to go by the device
+static __thread int currentpart = -1;
+//File the calling thread's accesses are counted for, -1 for none
+static __thread int currentfile = -1;
+//Lookups the calling thread has made, picks the ones that get timed
+static __thread unsigned int lookupcount = 0;
+//Function that writes a block to the device, used for write-through and to flush dirty lines
+static LcCacheWriter cachewriter = NULL;
+
+//Devices the cached blocks come from (a snapshot is only loaded into the same set)
+static LcCacheDevice cachedevices[LC_CACHE_MAXDEVICES];
+static int cachedevicecount = 0;
+
+//The active policy
+static cachepolicy *policy;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachekey
+// Description  : Pack a device/sector/block tuple into a single 64 bit key
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+// Outputs      : the packed key
+
+static uint64_t lcloud_cachekey( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    return( ((uint64_t)did << 32) | ((uint64_t)sec << 16) | (uint64_t)blk );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachehash
+// Description  : Find the ghost hash bucket for a packed key
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the bucket index
+
+static int lcloud_cachehash( cacheshard *s, uint64_t key ) {
+    //Multiplicative (fibonacci) hashing, keep the high bits for the bucket
+    return( (int)(((key + 1) * 0x9E3779B97F4A7C15ULL) >> (64 - s->hashbits)) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_linedata
+// Description  : Find the block of a cache line in the data slab
+//
+// Inputs       : s - the cache shard
+//                line - index of the cache line
+// Outputs      : pointer to the line's 256 byte block
+
+static char *lcloud_linedata( cacheshard *s, int line ) {
+    return (s->blocks + ((size_t)line << 8));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setmatch
+// Description  : Compare a tag against every way of a set, with one SSE2 compare when built for it
+//
+// Inputs       : tags - the set's tags (16 byte aligned, padded with LC_TAG_PAD)
+//                tag - the tag to look for
+// Outputs      : bit mask of the ways holding the tag
+
+static unsigned lcloud_setmatch( const uint8_t *tags, uint8_t tag ) {
+#if defined(__SSE2__)
+    __m128i eq = _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)tags), _mm_set1_epi8((char)tag));
+    return ((unsigned)_mm_movemask_epi8(eq));
+#else
+    unsigned mask = 0;
+
+    for (int w=0; w<LC_SET_WAYS; w++){
+        mask |= (unsigned)(tags[w] == tag) << w;
+    }
+    return (mask);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setof
+// Description  : Find the first set of the line index to probe for a key, and the key's tag
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+//                tag - set to the key's tag
+// Outputs      : the set index
+
+static int lcloud_setof( cacheshard *s, uint64_t key, uint8_t *tag ) {
+    uint64_t hash = (key + 1) * 0x9E3779B97F4A7C15ULL;
+
+    //The high bits pick the set and the seven bits below them make the tag
+    *tag = (uint8_t)((hash >> (57 - s->setbits)) & 0x7F);
+    return( (int)(hash >> (64 - s->setbits)) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_findline
+// Description  : Find the cache line holding a key using the line index
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the line index if found, -1 if not
+
+static int lcloud_findline( cacheshard *s, uint64_t key ) {
+    uint8_t tag;
+    int set = lcloud_setof(s, key, &tag), mask = (1 << s->setbits) - 1, line;
+    unsigned match;
+
+    //Check the lines whose tags match in each set on the probe sequence, a set with an empty way ends it
+    for (;;){
+        lineset *ls = &s->sets[set];
+
+        for (match = lcloud_setmatch(ls->tags, tag); match != 0; match &= match - 1){
+            line = ls->lines[__builtin_ctz(match)];
+            if (s->lrucache[line].key == key){
+                return (line);
+            }
+        }
+        if (lcloud_setmatch(ls->tags, LC_TAG_EMPTY) != 0){
+            return( -1 );
+        }
+        set = (set + 1) & mask;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_hashinsert
+// Description  : Add a cache line to the line index under its current key
+//
+// Inputs       : s - the cache shard
+//                line - index of the cache line
+// Outputs      : none
+
+static void lcloud_hashinsert( cacheshard *s, int line ) {
+    uint8_t tag;
+    int set = lcloud_setof(s, s->lrucache[line].key, &tag), mask = (1 << s->setbits) - 1, way;
+    unsigned open;
+
+    //Take the first empty or deleted way on the probe sequence (the index is never over 7/8 full)
+    for (;;){
+        lineset *ls = &s->sets[set];
+
+        if ((open = lcloud_setmatch(ls->tags, LC_TAG_EMPTY) | lcloud_setmatch(ls->tags, LC_TAG_DELETED)) != 0){
+            way = __builtin_ctz(open);
+            if (ls->tags[way] == LC_TAG_DELETED){
+                s->settombs--;
+            }
+            ls->tags[way] = tag;
+            ls->lines[way] = line;
+            return;
+        }
+        set = (set + 1) & mask;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_hashrebuild
+// Description  : Clear the tombstones out of the line index by putting every line back in, in
+//                place (no memory is needed, so it cannot fail and leave the tombstones behind)
+//
+// Inputs       : s - the cache shard
+// Outputs      : none
+
+static void lcloud_hashrebuild( cacheshard *s ) {
+    int sets = 1 << s->setbits, mask = sets - 1, home, line, way;
+    uint8_t tag;
+    unsigned open;
+
+    //Every tombstone goes back to empty and every line waits to be put back
+    for (int set=0; set<sets; set++){
+        for (int w=0; w<LC_SET_WAYS; w++){
+            if (s->sets[set].tags[w] == LC_TAG_DELETED){
+                s->sets[set].tags[w] = LC_TAG_EMPTY;
+            }
+            else if (s->sets[set].tags[w] != LC_TAG_EMPTY){
+                s->sets[set].tags[w] = LC_TAG_PENDING;
+            }
+        }
+    }
+    s->settombs = 0;
+
+    //Each waiting line goes in the first set on its probe sequence with an empty or waiting way:
+    // it stays put if that is the set it is in, takes an empty way, or swaps with a waiting line
+    // (which is then placed from this way in turn)
+    for (int set=0; set<sets; set++){
+        for (int w=0; w<LC_SET_WAYS; w++){
+            while (s->sets[set].tags[w] == LC_TAG_PENDING){
+                line = s->sets[set].lines[w];
+                home = lcloud_setof(s, s->lrucache[line].key, &tag);
+                while ((open = lcloud_setmatch(s->sets[home].tags, LC_TAG_EMPTY) |
+                        lcloud_setmatch(s->sets[home].tags, LC_TAG_PENDING)) == 0){
+                    home = (home + 1) & mask;
+                }
+                if (home == set){
+                    s->sets[set].tags[w] = tag;
+                    break;
+                }
+                way = __builtin_ctz(open);
+                if (s->sets[home].tags[way] == LC_TAG_EMPTY){
+                    s->sets[set].tags[w] = LC_TAG_EMPTY;
+                }
+                else{
+                    s->sets[set].lines[w] = s->sets[home].lines[way];
+                }
+                s->sets[home].tags[way] = tag;
+                s->sets[home].lines[way] = line;
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_hashremove
+// Description  : Remove a cache line from the line index
+//
+// Inputs       : s - the cache shard
+//                line - index of the cache line
+// Outputs      : none
+
+static void lcloud_hashremove( cacheshard *s, int line ) {
+    uint8_t tag;
+    int set = lcloud_setof(s, s->lrucache[line].key, &tag), mask = (1 << s->setbits) - 1, way;
+    unsigned match;
+
+    for (;;){
+        lineset *ls = &s->sets[set];
+
+        for (match = lcloud_setmatch(ls->tags, tag); match != 0; match &= match - 1){
+            way = __builtin_ctz(match);
+            if (ls->lines[way] != line){
+                continue;
+            }
+
+            //A set with an empty way never had a probe go past it, so the way can go back to empty
+            if (lcloud_setmatch(ls->tags, LC_TAG_EMPTY) != 0){
+                ls->tags[way] = LC_TAG_EMPTY;
+            }
+            else{
+                ls->tags[way] = LC_TAG_DELETED;
+                s->settombs++;
+            }
+
+            //Rebuild once lines and tombstones fill 7/8 of the ways, so probes always reach an empty way
+            if (s->maxsize + s->settombs > ((1 << s->setbits) * LC_SET_WAYS) / 8 * 7){
+                lcloud_hashrebuild(s);
+            }
+            return;
+        }
+        if (lcloud_setmatch(ls->tags, LC_TAG_EMPTY) != 0){
+            return;
+        }
+        set = (set + 1) & mask;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_linkof
+// Description  : Find the list links of a node (a cache line, a ghost, an MRC sample, a compressed
+//                entry or a disk tier entry)
+//
+// Inputs       : s - the cache shard
+//                node - line index, maxsize plus the ghost index, twice maxsize plus the sample index,
+//                       that plus mrcsize plus the compressed entry index, or that plus zsize plus
+//                       the disk tier entry index
+// Outputs      : pointer to the node's links
+
+static cachelink *lcloud_linkof( cacheshard *s, int node ) {
+    if (node < s->maxsize){
+        return (&s->lrucache[node].link);
+    }
+    if (node >= 2 * s->maxsize + s->mrcsize + s->zsize){
+        return (&s->l2entries[node - 2 * s->maxsize - s->mrcsize - s->zsize].link);
+    }
+    if (node >= 2 * s->maxsize + s->mrcsize){
+        return (&s->zentries[node - 2 * s->maxsize - s->mrcsize].link);
+    }
+    if (node >= 2 * s->maxsize){
+        return (&s->mrcsamples[node - 2 * s->maxsize].link);
+    }
+    return (&s->ghosts[node - s->maxsize].link);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_listunlink
+// Description  : Take a node out of one of the replacement lists
+//
+// Inputs       : s - the cache shard
+//                list - the list the node is on
+//                node - the node to remove
+// Outputs      : none
+
+static void lcloud_listunlink( cacheshard *s, cachelist *list, int node ) {
+    cachelink *link = lcloud_linkof(s, node);
+
+    //Point the neighbours (or the head/tail) past this node
+    if (link->prev != -1){
+        lcloud_linkof(s, link->prev)->next = link->next;
+    }
+    else{
+        list->head = link->next;
+    }
+    if (link->next != -1){
+        lcloud_linkof(s, link->next)->prev = link->prev;
+    }
+    else{
+        list->tail = link->prev;
+    }
+    link->prev = -1;
+    link->next = -1;
+    list->size--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_listpush
+// Description  : Put a node at the most recently used end (head) of a list
+//
+// Inputs       : s - the cache shard
+//                list - the list to add to
+//                node - the node to add (must not be on a list)
+// Outputs      : none
+
+static void lcloud_listpush( cacheshard *s, cachelist *list, int node ) {
+    cachelink *link = lcloud_linkof(s, node);
+
+    link->prev = -1;
+    link->next = list->head;
+    if (list->head != -1){
+        lcloud_linkof(s, list->head)->prev = node;
+    }
+    else{
+        list->tail = node;
+    }
+    list->head = node;
+    list->size++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_listappend
+// Description  : Put a node at the least recently used end (tail) of a list
+//
+// Inputs       : s - the cache shard
+//                list - the list to add to
+//                node - the node to add (must not be on a list)
+// Outputs      : none
+
+static void lcloud_listappend( cacheshard *s, cachelist *list, int node ) {
+    cachelink *link = lcloud_linkof(s, node);
+
+    link->prev = list->tail;
+    link->next = -1;
+    if (list->tail != -1){
+        lcloud_linkof(s, list->tail)->next = node;
+    }
+    else{
+        list->head = node;
+    }
+    list->tail = node;
+    list->size++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_partof
+// Description  : Find the partition a block goes in, the calling thread's or else its device's
+//
+// Inputs       : key - the packed device/sector/block key
+// Outputs      : the partition number
+
+static int lcloud_partof( uint64_t key ) {
+    return ((currentpart >= 0) ? currentpart : devpart[(key >> 32) & 0xFF]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_evictable
+// Description  : Check whether the policy may evict a line (not pinned, and in a partition
+//                the current eviction may take from)
+//
+// Inputs       : s - the cache shard
+//                line - the line index
+// Outputs      : 1 if it can be evicted, 0 if not
+
+static int lcloud_evictable( cacheshard *s, int line ) {
+    return (s->lrucache[line].pins == 0 && ((s->evictmask >> s->lrucache[line].part) & 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_partmask
+// Description  : Pick the partitions an eviction for a block of a partition should take from:
+//                its own if it is at its max, else any over their max, else any over their min
+//
+// Inputs       : s - the cache shard
+//                part - the partition of the block going in
+// Outputs      : mask of the partitions
+
+static unsigned lcloud_partmask( cacheshard *s, int part ) {
+    unsigned overmax = 0, overmin = 0;
+    int limit;
+
+    //The quotas are for the whole cache, each shard holds its share of them
+    for (int p=0; p<LC_CACHE_MAXPARTS; p++){
+        limit = (int)((int64_t)partmax[p] * s->maxsize / cacheblocks);
+        if (partmax[p] > 0 && s->partsize[p] >= (limit > 0 ? limit : 1)){
+            if (p == part){
+                return (1u << p);
+            }
+            overmax |= (1u << p);
+        }
+        if (s->partsize[p] > (int)((int64_t)partmin[p] * s->maxsize / cacheblocks)){
+            overmin |= (1u << p);
+        }
+    }
+    if (overmax != 0){
+        return (overmax);
+    }
+    return ((overmin != 0) ? overmin : LC_PART_ALL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_listvictim
+// Description  : Take the least recently used cache line that is not pinned off a list
+//
+// Inputs       : s - the cache shard
+//                list - the list of cache lines to take from
+// Outputs      : the line removed, -1 if every line on the list is pinned
+
+static int lcloud_listvictim( cacheshard *s, cachelist *list ) {
+    int node;
+
+    //Walk from the least recently used end past any pinned lines (or ones the quotas protect)
+    for (node = list->tail; node != -1; node = lcloud_linkof(s, node)->prev){
+        if (lcloud_evictable(s, node)){
+            lcloud_listunlink(s, list, node);
+            return (node);
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ghostfind
+// Description  : Find the ghost entry remembering an evicted key
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the ghost index if found, -1 if not
+
+static int lcloud_ghostfind( cacheshard *s, uint64_t key ) {
+    int g;
+
+    for (g = s->ghostbuckets[lcloud_cachehash(s, key)]; g != -1; g = s->ghosts[g].hashnext){
+        if (s->ghosts[g].key == key){
+            return (g);
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ghostdrop
+// Description  : Forget a ghost entry, taking it off its list and the hash index
+//
+// Inputs       : s - the cache shard
+//                g - the ghost index
+// Outputs      : none
+
+static void lcloud_ghostdrop( cacheshard *s, int g ) {
+    int *link = &s->ghostbuckets[lcloud_cachehash(s, s->ghosts[g].key)];
+
+    lcloud_listunlink(s, &s->lists[s->ghosts[g].list], s->maxsize + g);
+
+    //Splice the ghost out of its hash chain
+    while (*link != -1){
+        if (*link == g){
+            *link = s->ghosts[g].hashnext;
+            break;
+        }
+        link = &s->ghosts[*link].hashnext;
+    }
+
+    //Put the slot back on the free list
+    s->ghosts[g].link.next = s->ghostfree;
+    s->ghostfree = g;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ghostadd
+// Description  : Remember the key of an evicted line on a ghost list
+//
+// Inputs       : s - the cache shard
+//                key - the key of the evicted block
+//                list - the ghost list to put it on
+// Outputs      : none
+
+static void lcloud_ghostadd( cacheshard *s, uint64_t key, int list ) {
+    int g, bucket;
+
+    //If every slot is in use, recycle the oldest ghost of the same list
+    if (s->ghostfree == -1){
+        if (s->lists[list].tail == -1){
+            return;
+        }
+        lcloud_ghostdrop(s, s->lists[list].tail - s->maxsize);
+    }
+    g = s->ghostfree;
+    s->ghostfree = s->ghosts[g].link.next;
+
+    //Fill in the ghost and add it to the hash index and its list
+    bucket = lcloud_cachehash(s, key);
+    s->ghosts[g].key = key;
+    s->ghosts[g].list = list;
+    s->ghosts[g].hashnext = s->ghostbuckets[bucket];
+    s->ghostbuckets[bucket] = g;
+    lcloud_listpush(s, &s->lists[list], s->maxsize + g);
+}
+
+//
+// LRU policy, a single recency list
+
+static void lcloud_lruhit( cacheshard *s, int line ) {
+    //Move the line to the front of the list
+    lcloud_listunlink(s, &s->lists[LC_LIST_T1], line);
+    lcloud_listpush(s, &s->lists[LC_LIST_T1], line);
+}
+
+static int lcloud_lruvictim( cacheshard *s, int ghostlist ) {
+    return (lcloud_listvictim(s, &s->lists[LC_LIST_T1]));
+}
+
+static void lcloud_lruinsert( cacheshard *s, int line, int ghostlist ) {
+    s->lrucache[line].list = LC_LIST_T1;
+    lcloud_listpush(s, &s->lists[LC_LIST_T1], line);
+}
+
+static void lcloud_listremove( cacheshard *s, int line ) {
+    //Shared by LRU, 2Q and ARC, just take the line off whichever list it is on
+    lcloud_listunlink(s, &s->lists[s->lrucache[line].list], line);
+}
+
+static void lcloud_listrestore( cacheshard *s, int line ) {
+    //Shared by LRU, 2Q and ARC, put the line back at the evicting end of its list
+    lcloud_listappend(s, &s->lists[s->lrucache[line].list], line);
+}
+
+static void lcloud_noghosts( cacheshard *s, int line ) {
+    //Shared by LRU, CLOCK and LFU, which keep no ghosts of evicted keys
+}
+
+//
+// CLOCK policy, a reference bit per line and a hand sweeping the line array
+
+static void lcloud_clockhit( cacheshard *s, int line ) {
+    s->lrucache[line].ref = 1;
+}
+
+static int lcloud_clockvictim( cacheshard *s, int ghostlist ) {
+    int line;
+
+    //Give every referenced line a second chance until the hand finds one that was not,
+    // two full sweeps without a victim means every line is pinned
+    for (int steps=0; steps < 2 * s->maxsize; steps++){
+        line = s->clockhand;
+        s->clockhand = (s->clockhand + 1) % s->maxsize;
+        if (!lcloud_evictable(s, line)){
+            continue;
+        }
+        if (s->lrucache[line].ref == 1){
+            s->lrucache[line].ref = 0;
+            continue;
+        }
+        return (line);
+    }
+    return( -1 );
+}
+
+static void lcloud_clockinsert( cacheshard *s, int line, int ghostlist ) {
+    s->lrucache[line].ref = 0;
+}
+
+static void lcloud_clockremove( cacheshard *s, int line ) {
+    s->lrucache[line].ref = 0;
+}
+
+static void lcloud_clockrestore( cacheshard *s, int line ) {
+    //The line never left the clock, the hand has just moved past it
+}
+
+//
+// 2Q policy (Johnson and Shasha), new blocks go through the A1in FIFO and only
+// blocks seen again while remembered on A1out are promoted to the Am LRU list
+
+#define LC_LIST_A1IN LC_LIST_T1
+#define LC_LIST_AM LC_LIST_T2
+#define LC_LIST_A1OUT LC_LIST_B1
+
+static void lcloud_2qhit( cacheshard *s, int line ) {
+    //Only lines on Am move, A1in is a FIFO
+    if (s->lrucache[line].list == LC_LIST_AM){
+        lcloud_listunlink(s, &s->lists[LC_LIST_AM], line);
+        lcloud_listpush(s, &s->lists[LC_LIST_AM], line);
+    }
+}
+
+static int lcloud_2qvictim( cacheshard *s, int ghostlist ) {
+    int line;
+
+    //Evict from A1in while it is over its quarter of the cache
+    if (s->lists[LC_LIST_A1IN].size > s->maxsize / 4 || s->lists[LC_LIST_AM].size == 0){
+        if ((line = lcloud_listvictim(s, &s->lists[LC_LIST_A1IN])) != -1){
+            return (line);
+        }
+    }
+
+    //Otherwise evict the least recently used line of Am, falling back to A1in if Am is all pinned
+    if ((line = lcloud_listvictim(s, &s->lists[LC_LIST_AM])) != -1){
+        return (line);
+    }
+    return (lcloud_listvictim(s, &s->lists[LC_LIST_A1IN]));
+}
+
+static void lcloud_2qevicted( cacheshard *s, int line ) {
+    //Remember a key evicted from A1in on A1out, which holds at most half the cache size of keys
+    if (s->lrucache[line].list == LC_LIST_A1IN){
+        if (s->lists[LC_LIST_A1OUT].size >= (s->maxsize / 2 > 0 ? s->maxsize / 2 : 1)){
+            lcloud_ghostdrop(s, s->lists[LC_LIST_A1OUT].tail - s->maxsize);
+        }
+        lcloud_ghostadd(s, s->lrucache[line].key, LC_LIST_A1OUT);
+    }
+}
+
+static void lcloud_2qinsert( cacheshard *s, int line, int ghostlist ) {
+    //A block remembered on A1out has been seen twice, promote it to Am
+    if (ghostlist == LC_LIST_A1OUT){
+        s->lrucache[line].list = LC_LIST_AM;
+    }
+    else{
+        s->lrucache[line].list = LC_LIST_A1IN;
+    }
+    lcloud_listpush(s, &s->lists[s->lrucache[line].list], line);
+}
+
+//
+// ARC policy (Megiddo and Modha), T1/T2 hold blocks seen once/more than once,
+// B1/B2 remember their evicted keys and steer the T1 target size
+
+static void lcloud_archit( cacheshard *s, int line ) {
+    //Any hit makes the line frequent, move it to the front of T2
+    lcloud_listunlink(s, &s->lists[s->lrucache[line].list], line);
+    s->lrucache[line].list = LC_LIST_T2;
+    lcloud_listpush(s, &s->lists[LC_LIST_T2], line);
+}
+
+static int lcloud_arcvictim( cacheshard *s, int ghostlist ) {
+    int line;
+
+    //Evict from T1 when it is over target (or at target and the key came from B2)
+    if (s->lists[LC_LIST_T1].size > 0 &&
+        (s->lists[LC_LIST_T1].size > s->arctarget ||
+         (ghostlist == LC_LIST_B2 && s->lists[LC_LIST_T1].size == s->arctarget) ||
+         s->lists[LC_LIST_T2].size == 0)){
+        if ((line = lcloud_listvictim(s, &s->lists[LC_LIST_T1])) != -1){
+            return (line);
+        }
+        return (lcloud_listvictim(s, &s->lists[LC_LIST_T2]));
+    }
+
+    //Otherwise evict from T2
+    if ((line = lcloud_listvictim(s, &s->lists[LC_LIST_T2])) != -1){
+        return (line);
+    }
+    return (lcloud_listvictim(s, &s->lists[LC_LIST_T1]));
+}
+
+static void lcloud_arcevicted( cacheshard *s, int line ) {
+    //Remember the evicted key on the ghost list matching its list
+    lcloud_ghostadd(s, s->lrucache[line].key, (s->lrucache[line].list == LC_LIST_T1) ? LC_LIST_B1 : LC_LIST_B2);
+}
+
+static void lcloud_arcinsert( cacheshard *s, int line, int ghostlist ) {
+    //A key found on a ghost list was evicted too early (lcloud_arcadapt already
+    // moved the target for it), so the line goes straight to the frequent list
+    if (ghostlist != -1){
+        s->lrucache[line].list = LC_LIST_T2;
+    }
+    else{
+        s->lrucache[line].list = LC_LIST_T1;
+    }
+    lcloud_listpush(s, &s->lists[s->lrucache[line].list], line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_arcadapt
+// Description  : Adjust the ARC target before a miss picks its victim (the caller puts the
+//                old target back if no line is taken after all)
+//
+// Inputs       : s - the cache shard
+//                ghostlist - the ghost list the missed key was found on, -1 if none
+// Outputs      : none
+
+static void lcloud_arcadapt( cacheshard *s, int ghostlist ) {
+    int b1 = s->lists[LC_LIST_B1].size, b2 = s->lists[LC_LIST_B2].size;
+
+    //A hit on B1 means T1 was too small, a hit on B2 means T2 was
+    if (ghostlist == LC_LIST_B1){
+        s->arctarget += (b2 > b1 ? b2 / b1 : 1);
+        if (s->arctarget > s->maxsize){
+            s->arctarget = s->maxsize;
+        }
+    }
+    else if (ghostlist == LC_LIST_B2){
+        s->arctarget -= (b1 > b2 ? b1 / b2 : 1);
+        if (s->arctarget < 0){
+            s->arctarget = 0;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_arctrim
+// Description  : Trim the ghost lists once a line is really taken for a brand new key
+//
+// Inputs       : s - the cache shard
+//                line - the victim the line came from (already off its list), -1 if none
+// Outputs      : none
+
+static void lcloud_arctrim( cacheshard *s, int line ) {
+    int b1 = s->lists[LC_LIST_B1].size, b2 = s->lists[LC_LIST_B2].size;
+    int t1 = s->lists[LC_LIST_T1].size, t2 = s->lists[LC_LIST_T2].size;
+
+    //Count the victim where it was, the sizes are the ones ARC checks before it replaces a line
+    if (line != -1){
+        t1 += (s->lrucache[line].list == LC_LIST_T1);
+        t2 += (s->lrucache[line].list == LC_LIST_T2);
+    }
+
+    //Keep |T1|+|B1| <= c and the whole directory <= 2c
+    if (t1 + b1 >= s->maxsize){
+        if (b1 > 0){
+            lcloud_ghostdrop(s, s->lists[LC_LIST_B1].tail - s->maxsize);
+        }
+    }
+    else if (t1 + t2 + b1 + b2 >= 2 * s->maxsize && b2 > 0){
+        lcloud_ghostdrop(s, s->lists[LC_LIST_B2].tail - s->maxsize);
+    }
+}
+
+//
+// LFU policy, a min heap on access count with the oldest access breaking ties
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_lfuless
+// Description  : Compare the heap order of two lines
+//
+// Inputs       : s - the cache shard
+//                a, b - line indexes
+// Outputs      : 1 if a should be evicted before b, 0 if not
+
+static int lcloud_lfuless( cacheshard *s, int a, int b ) {
+    if (s->lrucache[a].freq != s->lrucache[b].freq){
+        return (s->lrucache[a].freq < s->lrucache[b].freq);
+    }
+    return (s->lrucache[a].stamp < s->lrucache[b].stamp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_lfuswap
+// Description  : Swap two heap slots and fix the lines' back pointers
+//
+// Inputs       : s - the cache shard
+//                i, j - heap slots
+// Outputs      : none
+
+static void lcloud_lfuswap( cacheshard *s, int i, int j ) {
+    int t = s->lfuheap[i];
+
+    s->lfuheap[i] = s->lfuheap[j];
+    s->lfuheap[j] = t;
+    s->lrucache[s->lfuheap[i]].heappos = i;
+    s->lrucache[s->lfuheap[j]].heappos = j;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_lfusift
+// Description  : Restore the heap order around a slot, moving it up or down
+//
+// Inputs       : s - the cache shard
+//                i - heap slot that may be out of order
+// Outputs      : none
+
+static void lcloud_lfusift( cacheshard *s, int i ) {
+    int child;
+
+    //Move up while smaller than the parent
+    while (i > 0 && lcloud_lfuless(s, s->lfuheap[i], s->lfuheap[(i - 1) / 2])){
+        lcloud_lfuswap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    //Move down while a child is smaller
+    while ((child = 2 * i + 1) < s->lfuheapsize){
+        if (child + 1 < s->lfuheapsize && lcloud_lfuless(s, s->lfuheap[child + 1], s->lfuheap[child])){
+            child++;
+        }
+        if (!lcloud_lfuless(s, s->lfuheap[child], s->lfuheap[i])){
+            break;
+        }
+        lcloud_lfuswap(s, i, child);
+        i = child;
+    }
+}
+
+static void lcloud_lfuhit( cacheshard *s, int line ) {
+    s->lrucache[line].freq++;
+    lcloud_lfusift(s, s->lrucache[line].heappos);
+}
+
+static void lcloud_lfupush( cacheshard *s, int line ) {
+    s->lrucache[line].heappos = s->lfuheapsize;
+    s->lfuheap[s->lfuheapsize] = line;
+    s->lfuheapsize++;
+    lcloud_lfusift(s, s->lrucache[line].heappos);
+}
+
+static int lcloud_lfupop( cacheshard *s ) {
+    int line = s->lfuheap[0];
+
+    //Move the last slot to the root and push it down
+    s->lfuheapsize--;
+    if (s->lfuheapsize > 0){
+        lcloud_lfuswap(s, 0, s->lfuheapsize);
+        lcloud_lfusift(s, 0);
+    }
+    s->lrucache[line].heappos = -1;
+    return (line);
+}
+
+static int lcloud_lfuvictim( cacheshard *s, int ghostlist ) {
+    int line = -1, held = -1, next;
+
+    //Pop lines until one can be evicted, holding the others aside on a chain through link.next
+    while (s->lfuheapsize > 0){
+        line = lcloud_lfupop(s);
+        if (lcloud_evictable(s, line)){
+            break;
+        }
+        s->lrucache[line].link.next = held;
+        held = line;
+        line = -1;
+    }
+
+    //Put the pinned lines back on the heap
+    while (held != -1){
+        next = s->lrucache[held].link.next;
+        s->lrucache[held].link.next = -1;
+        lcloud_lfupush(s, held);
+        held = next;
+    }
+    return (line);
+}
+
+static void lcloud_lfuinsert( cacheshard *s, int line, int ghostlist ) {
+    s->lrucache[line].freq = 1;
+    lcloud_lfupush(s, line);
+}
+
+static void lcloud_lfuremove( cacheshard *s, int line ) {
+    int pos = s->lrucache[line].heappos;
+
+    //Move the last slot into the line's slot and restore the order there
+    s->lfuheapsize--;
+    if (pos != s->lfuheapsize){
+        lcloud_lfuswap(s, pos, s->lfuheapsize);
+        lcloud_lfusift(s, pos);
+    }
+    s->lrucache[line].heappos = -1;
+}
+
+static void lcloud_lfurestore( cacheshard *s, int line ) {
+    lcloud_lfupush(s, line);
+}
+
+//Table of the policies, indexed by LcCachePolicy
+static cachepolicy cachepolicies[LC_CACHE_MAXPOLICY] = {
+    { "LRU", lcloud_lruhit, lcloud_lruvictim, lcloud_lruinsert, lcloud_listremove, lcloud_listrestore, lcloud_noghosts },
+    { "CLOCK", lcloud_clockhit, lcloud_clockvictim, lcloud_clockinsert, lcloud_clockremove, lcloud_clockrestore, lcloud_noghosts },
+    { "2Q", lcloud_2qhit, lcloud_2qvictim, lcloud_2qinsert, lcloud_listremove, lcloud_listrestore, lcloud_2qevicted },
+    { "ARC", lcloud_archit, lcloud_arcvictim, lcloud_arcinsert, lcloud_listremove, lcloud_listrestore, lcloud_arcevicted },
+    { "LFU", lcloud_lfuhit, lcloud_lfuvictim, lcloud_lfuinsert, lcloud_lfuremove, lcloud_lfurestore, lcloud_noghosts },
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachepolicybyname
+// Description  : Look up a replacement policy by its (case insensitive) name
+//
+// Inputs       : name - policy name, e.g. "lru" or "arc"
+// Outputs      : the policy, -1 if there is no policy with that name
+
+int lcloud_cachepolicybyname( const char *name ) {
+    for (int i=0; i<LC_CACHE_MAXPOLICY; i++){
+        if (strcasecmp(name, cachepolicies[i].name) == 0){
+            return (i);
+        }
+    }
+    return( -1 );
+}
+
+//
+// Miss ratio curve estimation (Waldspurger et al., SHARDS), an LRU reuse distance
+// histogram built from a spatially sampled subset of the keys
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_mrchash
+// Description  : Hash a key for the sampling decision (independent of the bucket and shard hashes)
+//
+// Inputs       : key - the packed device/sector/block key
+// Outputs      : 24 bit hash value
+
+static uint32_t lcloud_mrchash( uint64_t key ) {
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ULL;
+    key ^= key >> 33;
+    return ((uint32_t)(key & 0xFFFFFF));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_mrctreeadd
+// Description  : Add to the count at an access time in the Fenwick tree
+//
+// Inputs       : s - the cache shard
+//                time - the access time
+//                delta - the amount to add
+// Outputs      : none
+
+static void lcloud_mrctreeadd( cacheshard *s, int time, int delta ) {
+    for (int i = time + 1; i <= s->mrctreesize; i += i & (-i)){
+        s->mrctree[i - 1] += delta;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_mrctreesum
+// Description  : Count the sampled keys last used at or before an access time
+//
+// Inputs       : s - the cache shard
+//                time - the access time
+// Outputs      : the count
+
+static int lcloud_mrctreesum( cacheshard *s, int time ) {
+    int sum = 0;
+
+    for (int i = time + 1; i > 0; i -= i & (-i)){
+        sum += s->mrctree[i - 1];
+    }
+    return (sum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_mrccompact
+// Description  : Renumber the access times of the sampled keys from zero once the tree is full
+//
+// Inputs       : s - the cache shard
+// Outputs      : none
+
+static void lcloud_mrccompact( cacheshard *s ) {
+    int node, base = 2 * s->maxsize;
+
+    memset(s->mrctree, 0, sizeof(int) * s->mrctreesize);
+    s->mrctime = 0;
+
+    //Walk from the least recently used end so the order of the times is kept
+    for (node = s->mrclist.tail; node != -1; node = lcloud_linkof(s, node)->prev){
+        s->mrcsamples[node - base].time = s->mrctime;
+        lcloud_mrctreeadd(s, s->mrctime, 1);
+        s->mrctime++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_mrcaccess
+// Description  : Feed a use of a key to the miss ratio curve estimator, writes move the key
+//                up the recency list like they do in the cache but are not counted as lookups
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+//                counted - 1 for a lookup, 0 for a write
+// Outputs      : none
+
+static void lcloud_mrcaccess( cacheshard *s, uint64_t key, int counted ) {
+    int m, bucket, base = 2 * s->maxsize;
+    int *link;
+
+    //Only the keys that hash under the threshold are looked at
+    if (s->mrcsamples == NULL || lcloud_mrchash(key) >= s->mrcthreshold){
+        return;
+    }
+    s->mrcaccesses += counted;
+    bucket = (int)(((key + 1) * 0x9E3779B97F4A7C15ULL) >> (64 - s->mrcbits));
+    for (m = s->mrcbuckets[bucket]; m != -1; m = s->mrcsamples[m].hashnext){
+        if (s->mrcsamples[m].key == key){
+            break;
+        }
+    }
+
+    if (m != -1){
+        //Seen before, the sampled keys used since are the reuse distance, scale it up by the sampling rate
+        int distance = lcloud_mrctreesum(s, s->mrctime - 1) - lcloud_mrctreesum(s, s->mrcsamples[m].time);
+        int slot = (int)(distance * s->mrcscale / mrcwidth);
+
+        s->mrchist[(slot < LC_MRC_BUCKETS) ? slot : LC_MRC_BUCKETS] += counted;
+        lcloud_mrctreeadd(s, s->mrcsamples[m].time, -1);
+        lcloud_listunlink(s, &s->mrclist, base + m);
+    }
+    else{
+        //First use (or forgotten), which no cache size would hit
+        s->mrchist[LC_MRC_BUCKETS] += counted;
+
+        //Take a free sample, or forget the least recently used key, it is too far back to matter
+        if (s->mrcfree != -1){
+            m = s->mrcfree;
+            s->mrcfree = s->mrcsamples[m].link.next;
+        }
+        else{
+            m = s->mrclist.tail - base;
+            lcloud_listunlink(s, &s->mrclist, base + m);
+            lcloud_mrctreeadd(s, s->mrcsamples[m].time, -1);
+            link = &s->mrcbuckets[(int)(((s->mrcsamples[m].key + 1) * 0x9E3779B97F4A7C15ULL) >> (64 - s->mrcbits))];
+            while (*link != m){
+                link = &s->mrcsamples[*link].hashnext;
+            }
+            *link = s->mrcsamples[m].hashnext;
+        }
+        s->mrcsamples[m].key = key;
+        s->mrcsamples[m].hashnext = s->mrcbuckets[bucket];
+        s->mrcbuckets[bucket] = m;
+    }
+
+    //Stamp the key with the next access time and put it at the front of the recency list
+    if (s->mrctime == s->mrctreesize){
+        lcloud_mrccompact(s);
+    }
+    s->mrcsamples[m].time = s->mrctime;
+    lcloud_mrctreeadd(s, s->mrctime, 1);
+    s->mrctime++;
+    lcloud_listpush(s, &s->mrclist, base + m);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachemrc
+// Description  : Estimate the hit ratio an LRU cache of a given size would get on the reads seen so far
+//
+// Inputs       : blocks - the cache size (in blocks), up to 64 times the current size
+// Outputs      : the estimated hit ratio (0 to 1), -1 if there is no estimate
+
+double lcloud_cachemrc( int blocks ) {
+    int hits = 0, accesses = 0, slots;
+
+    if (shards == NULL || blocks < 1 || blocks > LC_MRC_MAXMULTIPLE * cacheblocks){
+        return( -1 );
+    }
+
+    //A reuse distance under the cache size is a hit, count the histogram slots that fit
+    slots = blocks / mrcwidth;
+    for (int j=0; j<shardcount; j++){
+        pthread_mutex_lock(&shards[j].lock);
+        for (int b=0; b<slots && b<LC_MRC_BUCKETS; b++){
+            hits += shards[j].mrchist[b];
+        }
+        accesses += shards[j].mrcaccesses;
+        pthread_mutex_unlock(&shards[j].lock);
+    }
+    if (accesses == 0){
+        return( -1 );
+    }
+    return ((double)hits / accesses);
+}
+
+//
+// Compressed tier, the block codec and the second level LRU below the cache lines
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_zputbits
+// Description  : Append a value to a little endian bit stream
+//
+// Inputs       : out - the output buffer
+//                pos - the byte position in the output
+//                acc - the bits not yet written out
+//                bits - the number of bits in acc
+//                value - the value to append
+//                width - the number of bits in value
+// Outputs      : none
+
+static void lcloud_zputbits( unsigned char *out, int *pos, uint64_t *acc, int *bits, uint32_t value, int width ) {
+    *acc |= (uint64_t)value << *bits;
+    *bits += width;
+    while (*bits >= 8){
+        out[(*pos)++] = (unsigned char)(*acc & 0xFF);
+        *acc >>= 8;
+        *bits -= 8;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_zgetbits
+// Description  : Take the next value from a little endian bit stream
+//
+// Inputs       : in - the input buffer
+//                pos - the byte position in the input
+//                acc - the bits read in but not yet used
+//                bits - the number of bits in acc
+//                width - the number of bits in the value
+// Outputs      : the value
+
+static uint32_t lcloud_zgetbits( const unsigned char *in, int *pos, uint64_t *acc, int *bits, int width ) {
+    uint32_t value;
+
+    while (*bits < width){
+        *acc |= (uint64_t)in[(*pos)++] << *bits;
+        *bits += 8;
+    }
+    value = (uint32_t)(*acc & ((1u << width) - 1));
+    *acc >>= width;
+    *bits -= width;
+    return (value);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_zcompress
+// Description  : Compress a block, dropping trailing zeros and packing text into fewer bits
+//
+// Inputs       : block - the 256 byte block
+//                out - the output buffer (at least LC_ZCODEC_MAXLEN bytes)
+// Outputs      : the compressed length
+
+static int lcloud_zcompress( const char *block, unsigned char *out ) {
+    const unsigned char *in = (const unsigned char *)block;
+    int n = 256, pos = LC_ZCODEC_HEADER, bits = 0, text = 1, ascii = 1;
+    uint64_t acc = 0;
+    uint32_t value;
+
+    //Trim the zeros off the end (the tail of a partly written block) and see what is left
+    while (n > 0 && in[n - 1] == 0){
+        n--;
+    }
+    for (int i=0; i<n; i++){
+        text &= (in[i] >= 32 && in[i] <= 126);
+        ascii &= (in[i] < 128);
+    }
+    out[1] = (unsigned char)(n & 0xFF);
+    out[2] = (unsigned char)(n >> 8);
+
+    if (text){
+        //Printable characters are base 95 digits, three of them fit in 20 bits
+        out[0] = LC_ZCODEC_TEXT;
+        for (int i=0; i<n; i+=3){
+            value = in[i] - 32;
+            value = value * 95 + ((i + 1 < n) ? in[i + 1] - 32 : 0);
+            value = value * 95 + ((i + 2 < n) ? in[i + 2] - 32 : 0);
+            lcloud_zputbits(out, &pos, &acc, &bits, value, 20);
+        }
+    }
+    else if (ascii){
+        out[0] = LC_ZCODEC_7BIT;
+        for (int i=0; i<n; i++){
+            lcloud_zputbits(out, &pos, &acc, &bits, in[i], 7);
+        }
+    }
+    else{
+        out[0] = LC_ZCODEC_RAW;
+        memcpy(&out[pos], in, n);
+        pos += n;
+    }
+    if (bits > 0){
+        out[pos++] = (unsigned char)(acc & 0xFF);
+    }
+    return (pos);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_zdecompress
+// Description  : Rebuild a block compressed by lcloud_zcompress
+//
+// Inputs       : in - the compressed data
+//                block - the 256 byte block to fill
+// Outputs      : none
+
+static void lcloud_zdecompress( const unsigned char *in, char *block ) {
+    unsigned char *out = (unsigned char *)block;
+    int n = in[1] | (in[2] << 8), pos = LC_ZCODEC_HEADER, bits = 0;
+    uint64_t acc = 0;
+    uint32_t value;
+
+    memset(block, 0, 256);
+    if (in[0] == LC_ZCODEC_TEXT){
+        for (int i=0; i<n; i+=3){
+            value = lcloud_zgetbits(in, &pos, &acc, &bits, 20);
+            if (i + 2 < n){
+                out[i + 2] = (unsigned char)(value % 95 + 32);
+            }
+            value /= 95;
+            if (i + 1 < n){
+                out[i + 1] = (unsigned char)(value % 95 + 32);
+            }
+            out[i] = (unsigned char)(value / 95 + 32);
+        }
+    }
+    else if (in[0] == LC_ZCODEC_7BIT){
+        for (int i=0; i<n; i++){
+            out[i] = (unsigned char)lcloud_zgetbits(in, &pos, &acc, &bits, 7);
+        }
+    }
+    else{
+        memcpy(out, &in[pos], n);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_zbucket
+// Description  : Find the compressed tier hash bucket for a key
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the bucket index
+
+static int lcloud_zbucket( cacheshard *s, uint64_t key ) {
+    return ((int)(((key + 1) * 0x9E3779B97F4A7C15ULL) >> (64 - s->zbits)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_zfind
+// Description  : Look up a key in the compressed tier
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the entry index, -1 if not there
+
+static int lcloud_zfind( cacheshard *s, uint64_t key ) {
+    if (s->zentries == NULL){
+        return( -1 );
+    }
+    for (int z = s->zbuckets[lcloud_zbucket(s, key)]; z != -1; z = s->zentries[z].hashnext){
+        if (s->zentries[z].key == key){
+            return (z);
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_zremove
+// Description  : Take an entry out of the compressed tier and free its data
+//
+// Inputs       : s - the cache shard
+//                z - the entry index
+// Outputs      : none
+
+static void lcloud_zremove( cacheshard *s, int z ) {
+    int *link = &s->zbuckets[lcloud_zbucket(s, s->zentries[z].key)];
+
+    while (*link != z){
+        link = &s->zentries[*link].hashnext;
+    }
+    *link = s->zentries[z].hashnext;
+    lcloud_listunlink(s, &s->zlist, 2 * s->maxsize + s->mrcsize + z);
+    s->zbytes -= s->zentries[z].len + (int)sizeof(zentry);
+    free(s->zentries[z].data);
+    s->zentries[z].data = NULL;
+    s->zentries[z].link.next = s->zfree;
+    s->zfree = z;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_zdrop
+// Description  : Forget any compressed copy of a key (a newer copy is going into a line)
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : none
+
+static void lcloud_zdrop( cacheshard *s, uint64_t key ) {
+    int z;
+
+    if ((z = lcloud_zfind(s, key)) != -1){
+        lcloud_zremove(s, z);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_zstore
+// Description  : Compress a clean line being evicted into the compressed tier
+//
+// Inputs       : s - the cache shard
+//                line - the line index
+// Outputs      : none
+
+static void lcloud_zstore( cacheshard *s, int line ) {
+    unsigned char buf[LC_ZCODEC_MAXLEN];
+    unsigned char *data;
+    int z, len;
+
+    if (s->zentries == NULL){
+        return;
+    }
+    len = lcloud_zcompress(lcloud_linedata(s, line), buf);
+    if (len + (int)sizeof(zentry) > s->zmaxbytes || (data = (unsigned char *)malloc(len)) == NULL){
+        return;
+    }
+
+    //Make room by dropping the least recently used compressed blocks
+    while (s->zlist.tail != -1 && (s->zfree == -1 || s->zbytes + len + (int)sizeof(zentry) > s->zmaxbytes)){
+        lcloud_zremove(s, s->zlist.tail - 2 * s->maxsize - s->mrcsize);
+        s->zevicted++;
+    }
+
+    z = s->zfree;
+    s->zfree = s->zentries[z].link.next;
+    memcpy(data, buf, len);
+    s->zentries[z].key = s->lrucache[line].key;
+    s->zentries[z].len = len;
+    s->zentries[z].data = data;
+    s->zentries[z].hashnext = s->zbuckets[lcloud_zbucket(s, s->zentries[z].key)];
+    s->zbuckets[lcloud_zbucket(s, s->zentries[z].key)] = z;
+    lcloud_listpush(s, &s->zlist, 2 * s->maxsize + s->mrcsize + z);
+    s->zbytes += len + (int)sizeof(zentry);
+    s->zstored++;
+    s->zinbytes += len;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_l2bucket
+// Description  : Find the disk tier hash bucket for a key
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the bucket index
+
+static int lcloud_l2bucket( cacheshard *s, uint64_t key ) {
+    return ((int)(((key + 1) * 0x9E3779B97F4A7C15ULL) >> (64 - s->l2bits)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_l2find
+// Description  : Look up a key in the disk tier
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the entry index, -1 if not there
+
+static int lcloud_l2find( cacheshard *s, uint64_t key ) {
+    if (s->l2entries == NULL){
+        return( -1 );
+    }
+    for (int e = s->l2buckets[lcloud_l2bucket(s, key)]; e != -1; e = s->l2entries[e].hashnext){
+        if (s->l2entries[e].key == key){
+            return (e);
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_l2remove
+// Description  : Take an entry out of the disk tier, freeing its slot
+//
+// Inputs       : s - the cache shard
+//                e - the entry index
+// Outputs      : none
+
+static void lcloud_l2remove( cacheshard *s, int e ) {
+    int *link = &s->l2buckets[lcloud_l2bucket(s, s->l2entries[e].key)];
+
+    while (*link != e){
+        link = &s->l2entries[*link].hashnext;
+    }
+    *link = s->l2entries[e].hashnext;
+    lcloud_listunlink(s, &s->l2list, 2 * s->maxsize + s->mrcsize + s->zsize + e);
+    s->l2entries[e].link.next = s->l2free;
+    s->l2free = e;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_l2store
+// Description  : Copy a clean line being evicted to the disk tier, dropping the least recently
+//                used disk block if the shard's part of the file is full
+//
+// Inputs       : s - the cache shard
+//                line - the line index
+// Outputs      : none
+
+static void lcloud_l2store( cacheshard *s, int line ) {
+    uint64_t key = s->lrucache[line].key;
+    int e, bucket;
+
+    if (s->l2entries == NULL){
+        return;
+    }
+    if (s->l2free == -1){
+        lcloud_l2remove(s, s->l2list.tail - 2 * s->maxsize - s->mrcsize - s->zsize);
+        s->l2evicted++;
+    }
+
+    e = s->l2free;
+    s->l2free = s->l2entries[e].link.next;
+    memcpy(s->l2data + ((size_t)e << 8), lcloud_linedata(s, line), 256);
+    bucket = lcloud_l2bucket(s, key);
+    s->l2entries[e].key = key;
+    s->l2entries[e].hashnext = s->l2buckets[bucket];
+    s->l2buckets[bucket] = e;
+    lcloud_listpush(s, &s->l2list, 2 * s->maxsize + s->mrcsize + s->zsize + e);
+    s->l2stored++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmsetof
+// Description  : Find the set of the shared memory tier a key goes in
+//
+// Inputs       : key - the packed device/sector/block key
+// Outputs      : the set
+
+static shmset *lcloud_shmsetof( uint64_t key ) {
+    return (&shmsets[(uint32_t)(((key + 1) * 0x9E3779B97F4A7C15ULL) >> 32) & shmmask]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmwrite
+// Description  : Change a slot of the shared memory tier (set locked), making seq odd
+//                around the change so readers in other processes throw away a torn copy
+//
+// Inputs       : slot - the slot
+//                key - the new slot key (packed key plus one, 0 to empty it)
+//                block - the new 256 byte block, NULL to leave the data
+// Outputs      : none
+
+static void lcloud_shmwrite( shmslot *slot, uint64_t key, const char *block ) {
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->key, key, __ATOMIC_RELAXED);
+    if (block != NULL){
+        memcpy(slot->data, block, 256);
+    }
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmlock
+// Description  : Take the lock of a set of the shared memory tier. If the process that held it
+//                died midway through a change, the set cannot be trusted: it is emptied (each
+//                slot's seq moved on to a new even value, so no reader keeps an old copy) and the
+//                lock made usable again.
+//
+// Inputs       : set - the set
+// Outputs      : 0 if locked, -1 if failure
+
+static int lcloud_shmlock( shmset *set ) {
+    uint32_t seq;
+    int ret;
+
+    if ((ret = pthread_mutex_lock(&set->lock)) == EOWNERDEAD){
+        logMessage(LOG_ERROR_LEVEL, "Shared memory tier set %d was left locked by a process that died, emptying it",
+         (int)(set - shmsets));
+        for (int w=0; w<LC_SHM_WAYS; w++){
+            seq = __atomic_load_n(&set->slots[w].seq, __ATOMIC_RELAXED);
+            __atomic_store_n(&set->slots[w].seq, (seq | 1) + 1, __ATOMIC_RELAXED);
+            lcloud_shmwrite(&set->slots[w], 0, NULL);
+            __atomic_store_n(&set->slots[w].ref, 0, __ATOMIC_RELAXED);
+        }
+        set->hand = 0;
+        ret = pthread_mutex_consistent(&set->lock);
+    }
+    if (ret != 0){
+        logMessage(LOG_ERROR_LEVEL, "Unable to lock shared memory tier set %d", (int)(set - shmsets));
+        return( -1 );
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmunlock
+// Description  : Release the spinlock of a set of the shared memory tier
+//
+// Inputs       : set - the set
+// Outputs      : none
+
+static void lcloud_shmunlock( shmset *set ) {
+    pthread_mutex_unlock(&set->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmload
+// Description  : Copy a block out of the shared memory tier without locking, marking
+//                it used for the CLOCK hand
+//
+// Inputs       : key - the packed device/sector/block key
+//                block - buffer for the 256 byte block
+// Outputs      : 0 if found, -1 if not (or a writer kept changing it)
+
+static int lcloud_shmload( uint64_t key, char *block ) {
+    shmset *set;
+    shmslot *slot;
+    uint32_t seq;
+
+    if (shmsets == NULL){
+        return( -1 );
+    }
+    set = lcloud_shmsetof(key);
+    for (int w=0; w<LC_SHM_WAYS; w++){
+        slot = &set->slots[w];
+        if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) != key + 1){
+            continue;
+        }
+        for (int tries=0; tries<LC_SHM_RETRIES; tries++){
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1){
+                continue;
+            }
+            memcpy(block, slot->data, 256);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq){
+                continue;
+            }
+            //The copy is whole, but the slot may have been given to another key before it started
+            if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) != key + 1){
+                return( -1 );
+            }
+            if (__atomic_load_n(&slot->ref, __ATOMIC_RELAXED) == 0){
+                __atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+            }
+            return( 0 );
+        }
+        return( -1 );
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmfind
+// Description  : Check whether the shared memory tier holds a key (a racy peek, no copy)
+//
+// Inputs       : key - the packed device/sector/block key
+// Outputs      : 1 if it does, 0 if not
+
+static int lcloud_shmfind( uint64_t key ) {
+    shmset *set;
+
+    if (shmsets == NULL){
+        return( 0 );
+    }
+    set = lcloud_shmsetof(key);
+    for (int w=0; w<LC_SHM_WAYS; w++){
+        if (__atomic_load_n(&set->slots[w].key, __ATOMIC_RELAXED) == key + 1){
+            return( 1 );
+        }
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmstore
+// Description  : Publish a block to the shared memory tier for the other processes, overwriting
+//                its slot or taking an empty one or the one the set's CLOCK hand stops at
+//
+// Inputs       : s - the cache shard (for its counters)
+//                key - the packed device/sector/block key
+//                block - the 256 byte block
+// Outputs      : none
+
+static void lcloud_shmstore( cacheshard *s, uint64_t key, const char *block ) {
+    shmset *set;
+    shmslot *slot = NULL;
+
+    if (shmsets == NULL){
+        return;
+    }
+    set = lcloud_shmsetof(key);
+    if (lcloud_shmlock(set) != 0){
+        return;
+    }
+    for (int w=0; w<LC_SHM_WAYS && slot == NULL; w++){
+        if (set->slots[w].key == key + 1){
+            slot = &set->slots[w];
+        }
+    }
+    for (int w=0; w<LC_SHM_WAYS && slot == NULL; w++){
+        if (set->slots[w].key == 0){
+            slot = &set->slots[w];
+        }
+    }
+    while (slot == NULL){
+        //Pass over slots used since the hand last came by, taking the first that was not
+        set->hand = (set->hand + 1) % LC_SHM_WAYS;
+        if (__atomic_load_n(&set->slots[set->hand].ref, __ATOMIC_RELAXED) == 0){
+            slot = &set->slots[set->hand];
+        }
+        else{
+            __atomic_store_n(&set->slots[set->hand].ref, 0, __ATOMIC_RELAXED);
+        }
+    }
+    lcloud_shmwrite(slot, key + 1, block);
+    __atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+    lcloud_shmunlock(set);
+    s->shmstored++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmdrop
+// Description  : Take a key out of the shared memory tier (its copy there is out of date)
+//
+// Inputs       : key - the packed device/sector/block key
+// Outputs      : none
+
+static void lcloud_shmdrop( uint64_t key ) {
+    shmset *set;
+
+    if (shmsets == NULL || !lcloud_shmfind(key)){
+        return;
+    }
+    set = lcloud_shmsetof(key);
+    if (lcloud_shmlock(set) != 0){
+        return;
+    }
+    for (int w=0; w<LC_SHM_WAYS; w++){
+        if (set->slots[w].key == key + 1){
+            lcloud_shmwrite(&set->slots[w], 0, NULL);
+            __atomic_store_n(&set->slots[w].ref, 0, __ATOMIC_RELAXED);
+        }
+    }
+    lcloud_shmunlock(set);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_dropcopies
+// Description  : Forget any compressed or disk tier copy of a key (a newer copy is going into
+//                a line, or the block is being discarded)
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : none
+
+static void lcloud_dropcopies( cacheshard *s, uint64_t key ) {
+    int e;
+
+    lcloud_zdrop(s, key);
+    if ((e = lcloud_l2find(s, key)) != -1){
+        lcloud_l2remove(s, e);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_hitline
+// Description  : Tell the policy a line was used, counting the first use of a prefetched line
+//
+// Inputs       : s - the cache shard
+//                line - the line index
+// Outputs      : none
+
+static void lcloud_hitline( cacheshard *s, int line ) {
+    if (s->lrucache[line].prefetched){
+        s->lrucache[line].prefetched = 0;
+        s->prefetchhits++;
+    }
+    s->lrucache[line].stamp = ++s->accesscount;
+    policy->hit(s, line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_count
+// Description  : Add to one of the event counters, for the shard and for the device and file
+//
+// Inputs       : s - the cache shard
+//                devid - the device of the block
+//                file - the file the event is charged to, -1 for none
+//                field - offset of the counter in LcCacheCounters
+//                n - the amount to add
+// Outputs      : none
+
+static void lcloud_count( cacheshard *s, int devid, int file, size_t field, uint64_t n ) {
+    *(uint64_t *)((char *)&s->total + field) += n;
+    if (devid >= 0 && devid < LC_CACHE_STATDEVICES){
+        *(uint64_t *)((char *)&s->devstats[devid] + field) += n;
+    }
+    if (file >= 0 && file < LC_CACHE_STATFILES){
+        *(uint64_t *)((char *)&s->filestats[file] + field) += n;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_clock
+// Description  : Read the monotonic clock if the calling thread's lookup is one that gets timed
+//
+// Inputs       : none
+// Outputs      : the time in nanoseconds, 0 if this lookup is not timed
+
+static uint64_t lcloud_clock( void ) {
+    struct timespec ts;
+
+    if ((lookupcount++ % LC_LATENCY_SAMPLE) != 0){
+        return (0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_timelookup
+// Description  : Put the time a lookup took (lock wait and any load included) in the latency histogram
+//
+// Inputs       : s - the (locked) cache shard
+//                start - lcloud_clock when the lookup started (0 if it is not timed)
+// Outputs      : none
+
+static void lcloud_timelookup( cacheshard *s, uint64_t start ) {
+    struct timespec ts;
+    uint64_t ns;
+    int b = 0;
+
+    if (start == 0){
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec - start;
+    while (b < LC_CACHE_LATBUCKETS - 1 && (ns >> (b + 1)) != 0){
+        b++;
+    }
+    s->latency[b]++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushline
+// Description  : Write a dirty cache line back to its device. The shard is unlocked while the
+//                block goes over the bus, with the line pinned (so it is not evicted) and marked
+//                loading (so anyone after its block waits rather than changing it midway).
+//
+// Inputs       : s - the (locked) cache shard
+//                line - the line index
+// Outputs      : 0 if successful (or the line was clean), -1 if failure
+
+static int lcloud_flushline( cacheshard *s, int line ) {
+    int failed;
+
+    if (s->lrucache[line].dirty == 0){
+        return (0);
+    }
+    s->lrucache[line].pins++;
+    s->lrucache[line].loading = 1;
+    pthread_mutex_unlock(&s->lock);
+    failed = (cachewriter == NULL || cachewriter((LcDeviceId)s->lrucache[line].devid, s->lrucache[line].sector,
+        s->lrucache[line].block, lcloud_linedata(s, line)) != 0);
+    pthread_mutex_lock(&s->lock);
+    s->lrucache[line].loading = 0;
+    s->lrucache[line].pins--;
+    pthread_cond_broadcast(&s->loaded);
+    if (failed){
+        logMessage(LOG_ERROR_LEVEL, "Failed flushing cache block [%d/%d/%d]",
+         s->lrucache[line].devid, s->lrucache[line].sector, s->lrucache[line].block);
+        return( -1 );
+    }
+    s->lrucache[line].dirty = 0;
+    lcloud_count(s, s->lrucache[line].devid, s->lrucache[line].file, offsetof(LcCacheCounters, writes), 1);
+    lcloud_count(s, s->lrucache[line].devid, s->lrucache[line].file, offsetof(LcCacheCounters, flushes), 1);
+    lcloud_shmstore(s, s->lrucache[line].key, lcloud_linedata(s, line));
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_sketchslot
+// Description  : Find a key's counter in one row of the admission sketch (double hashing
+//                from one 64 bit hash gives each row its own independent-enough slot)
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+//                row - the sketch row
+// Outputs      : index of the counter in the sketch
+
+static int lcloud_sketchslot( cacheshard *s, uint64_t key, int row ) {
+    uint64_t hash = (key ^ (key >> 31)) * 0xD6E8FEB86659FD93ULL;
+    uint32_t h1 = (uint32_t)(hash >> 32), h2 = (uint32_t)hash | 1;
+
+    return ((row << s->sketchbits) + (int)((h1 + (uint32_t)row * h2) & ((1u << s->sketchbits) - 1)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_sketchadd
+// Description  : Count an access to a key in the admission sketch, halving every counter once
+//                a sample period of accesses has been counted so old popularity fades
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : none
+
+static void lcloud_sketchadd( cacheshard *s, uint64_t key ) {
+    int slot;
+
+    if (s->sketch == NULL){
+        return;
+    }
+    for (int r=0; r<LC_SKETCH_ROWS; r++){
+        slot = lcloud_sketchslot(s, key, r);
+        if (s->sketch[slot] < LC_SKETCH_MAXCOUNT){
+            s->sketch[slot]++;
+        }
+    }
+    if (++s->sketchadds >= s->sketchperiod){
+        for (int i=0; i<(LC_SKETCH_ROWS << s->sketchbits); i++){
+            s->sketch[i] >>= 1;
+        }
+        s->sketchadds /= 2;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_sketchcount
+// Description  : Estimate how often a key was accessed lately (the smallest of its counters)
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the estimated count
+
+static int lcloud_sketchcount( cacheshard *s, uint64_t key ) {
+    int count = LC_SKETCH_MAXCOUNT, slot;
+
+    for (int r=0; r<LC_SKETCH_ROWS; r++){
+        slot = lcloud_sketchslot(s, key, r);
+        if (s->sketch[slot] < count){
+            count = s->sketch[slot];
+        }
+    }
+    return (count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_countaccess
+// Description  : Count a lookup as a hit or miss, for the shard, device, file and partition, the
+//                MRC and the admission sketch
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+//                hit - 1 for a hit, 0 for a miss
+// Outputs      : none
+
+static void lcloud_countaccess( cacheshard *s, uint64_t key, int hit ) {
+    int devid = (int)(key >> 32);
+
+    if (hit){
+        lcloud_count(s, devid, currentfile, offsetof(LcCacheCounters, hits), 1);
+        lcloud_count(s, devid, currentfile, offsetof(LcCacheCounters, bytessaved), 256);
+        s->parthits[lcloud_partof(key)]++;
+    }
+    else{
+        lcloud_count(s, devid, currentfile, offsetof(LcCacheCounters, misses), 1);
+        s->partmisses[lcloud_partof(key)]++;
+    }
+    lcloud_mrcaccess(s, key, 1);
+    lcloud_sketchadd(s, key);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_forgetghost
+// Description  : Forget the ghost of a key a line has been taken for (for ARC, trimming the
+//                ghost lists instead if the key is brand new)
+//
+// Inputs       : s - the cache shard
+//                g - the key's ghost index, -1 if it has none
+//                line - the victim the line came from, -1 if none
+// Outputs      : none
+
+static void lcloud_forgetghost( cacheshard *s, int g, int line ) {
+    if (g != -1){
+        lcloud_ghostdrop(s, g);
+    }
+    else if (policy == &cachepolicies[LC_CACHE_ARC]){
+        lcloud_arctrim(s, line);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_takeline
+// Description  : Find a line for a block that is not in the cache, evicting one if the cache is full
+//
+// Inputs       : s - the cache shard
+//                key - the packed key of the block that will go in the line
+//                ghostlist - set to the ghost list the key was remembered on, -1 if none
+//                admit - 1 to let the admission filter (if on) turn the block away, 0 to always take a line
+// Outputs      : the line index, -1 if every line is pinned (or a dirty victim could not be written
+//                back), LC_LINE_REJECTED if turned away, LC_LINE_RETRY if the shard was unlocked to
+//                write back a victim (the caller looks for the block again, it may be there now)
+
+static int lcloud_takeline( cacheshard *s, uint64_t key, int *ghostlist, int admit ) {
+    int g = -1, line = -1, target = s->arctarget;
+
+    //See if the policy remembers evicting this key, if so note the list (the ghost is only
+    // forgotten once a line is really taken for the key)
+    *ghostlist = -1;
+    if (s->ghosts != NULL && (g = lcloud_ghostfind(s, key)) != -1){
+        *ghostlist = s->ghosts[g].list;
+    }
+    if (policy == &cachepolicies[LC_CACHE_ARC]){
+        lcloud_arcadapt(s, *ghostlist);
+    }
+
+    //Reuse a line given back by a failed load, then any line never used
+    if (s->linefree != -1){
+        line = s->linefree;
+        s->linefree = s->lrucache[line].hashnext;
+    }
+    else if (s->currentsize < s->maxsize){
+        line = s->currentsize;
+        s->currentsize++;
+    }
+    if (line != -1){
+        lcloud_forgetghost(s, g, -1);
+        return (line);
+    }
+
+    //If the cache is full, let the policy pick the line to evict from the partitions the quotas
+    // point at (any partition if none of those has an unpinned line)
+    s->evictmask = (partitioned ? lcloud_partmask(s, lcloud_partof(key)) : LC_PART_ALL);
+    line = policy->victim(s, *ghostlist);
+    if (line == -1 && s->evictmask != LC_PART_ALL){
+        s->evictmask = LC_PART_ALL;
+        line = policy->victim(s, *ghostlist);
+    }
+    s->evictmask = LC_PART_ALL;
+    if (line == -1){
+        s->arctarget = target;
+        logMessage(LOG_ERROR_LEVEL, "Cache has no unpinned line to evict");
+        return( -1 );
+    }
+
+    //TinyLFU admission, keep the victim unless the new block was used more often lately (a block
+    // read once by a scan never is, so a scan cannot push out the working set). This is decided
+    // before any ghost is made or forgotten, a turned away block leaves ARC and 2Q as they were.
+    if (admit && s->sketch != NULL && lcloud_sketchcount(s, key) < lcloud_sketchcount(s, s->lrucache[line].key)){
+        policy->restore(s, line);
+        s->arctarget = target;
+        s->rejected++;
+        return( LC_LINE_REJECTED );
+    }
+
+    //A dirty victim is written back first, it stays indexed and dirty (and is not reused) if that
+    // fails. The shard is unlocked meanwhile, so the caller has to look again afterwards.
+    if (s->lrucache[line].dirty){
+        policy->restore(s, line);
+        s->arctarget = target;
+        return ((lcloud_flushline(s, line) == 0) ? LC_LINE_RETRY : -1);
+    }
+    if (admit && s->sketch != NULL){
+        s->admitted++;
+    }
+    lcloud_forgetghost(s, g, line);
+    policy->evicted(s, line);
+    lcloud_count(s, s->lrucache[line].devid, s->lrucache[line].file, offsetof(LcCacheCounters, evictions), 1);
+    s->partsize[s->lrucache[line].part]--;
+    if (s->lrucache[line].prefetched){
+        s->prefetchwasted++;
+    }
+    lcloud_zstore(s, line);
+    lcloud_l2store(s, line);
+    lcloud_hashremove(s, line);
+    return (line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_fillline
+// Description  : Make a line taken by lcloud_takeline hold a block, indexing it and handing it to the policy
+//
+// Inputs       : s - the cache shard
+//                line - the line index
+//                key - the packed key of the block now in the line
+//                ghostlist - the ghost list from lcloud_takeline
+// Outputs      : none
+
+static void lcloud_fillline( cacheshard *s, int line, uint64_t key, int ghostlist ) {
+    s->lrucache[line].dirty = 0;
+    s->lrucache[line].prefetched = 0;
+    s->lrucache[line].devid = (int)(key >> 32);
+    s->lrucache[line].sector = (int)((key >> 16) & 0xFFFF);
+    s->lrucache[line].block = (int)(key & 0xFFFF);
+    s->lrucache[line].key = key;
+    s->lrucache[line].stamp = ++s->accesscount;
+    s->lrucache[line].part = lcloud_partof(key);
+    s->lrucache[line].file = currentfile;
+    s->partsize[s->lrucache[line].part]++;
+    lcloud_count(s, s->lrucache[line].devid, currentfile, offsetof(LcCacheCounters, insertions), 1);
+    lcloud_dropcopies(s, key);
+    lcloud_hashinsert(s, line);
+    policy->insert(s, line, ghostlist);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_lookupline
+// Description  : Find the line holding a key, bringing it up from the compressed tier, the
+//                disk tier or the shared memory tier if it is there
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the line index, -1 if the block is not cached
+
+static int lcloud_lookupline( cacheshard *s, uint64_t key ) {
+    char block[256];
+    int i, z, e, ghostlist, *hits;
+
+    //Taking a line may unlock the shard to write back a victim, if so look again from the start
+    do {
+        if ((i = lcloud_findline(s, key)) != -1){
+            return (i);
+        }
+
+        //Decompress or copy it out before taking a line (the eviction may push the entry out of
+        // its tier), lcloud_fillline lets go of the entry once the block is in the line
+        if ((z = lcloud_zfind(s, key)) != -1){
+            lcloud_zdecompress(s->zentries[z].data, block);
+            hits = &s->zhits;
+        }
+        else if ((e = lcloud_l2find(s, key)) != -1){
+            memcpy(block, s->l2data + ((size_t)e << 8), 256);
+            hits = &s->l2hits;
+        }
+        else if (lcloud_shmload(key, block) == 0){
+            //Another process (or this one) read it from the device already, the shared copy stays put
+            hits = &s->shmhits;
+        }
+        else{
+            return( -1 );
+        }
+    } while ((i = lcloud_takeline(s, key, &ghostlist, 0)) == LC_LINE_RETRY);
+    if (i == -1){
+        return( -1 );
+    }
+    (*hits)++;
+    memcpy(lcloud_linedata(s, i), block, 256);
+    lcloud_fillline(s, i, key, ghostlist);
+    return (i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shardof
+// Description  : Find the shard a block lives in
+//
+// Inputs       : key - the packed device/sector/block key
+// Outputs      : the shard
+
+static cacheshard *lcloud_shardof( uint64_t key ) {
+    //Use a different multiplier than the bucket hash so the shard does not pick the bucket
+    if (shardbits == 0){
+        return (&shards[0]);
+    }
+    return (&shards[(key * 0xFF51AFD7ED558CCDULL) >> (64 - shardbits)]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_waitload
+// Description  : Wait (giving up the shard lock) while another thread is loading a block into
+//                its line, the caller then finds it there or, if that load failed, not at all
+//
+// Inputs       : s - the (locked) cache shard
+//                key - the packed device/sector/block key
+// Outputs      : 1 if the caller waited, 0 if no load of the block was going
+
+static int lcloud_waitload( cacheshard *s, uint64_t key ) {
+    int i, waited = 0;
+
+    while ((i = lcloud_findline(s, key)) != -1 && s->lrucache[i].loading){
+        pthread_cond_wait(&s->loaded, &s->lock);
+        waited = 1;
+    }
+    return (waited);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_putline
+// Description  : Put a block in a shard, overwriting the line that holds it or filling a new one
+//
+// Inputs       : s - the (locked) cache shard
+//                key - the packed key of the block
+//                block - the 256 byte block
+//                admit - 1 to let the admission filter turn a new block away
+// Outputs      : the line index, -1 if failure, LC_LINE_REJECTED if turned away
+
+static int lcloud_putline( cacheshard *s, uint64_t key, char *block, int admit ) {
+    int i, ghostlist;
+
+    //Taking a line may unlock the shard to write back a victim, if so look again from the start
+    do {
+        //If the block was already in the cache, replace the data and tell the policy
+        lcloud_waitload(s, key);
+        if ((i = lcloud_findline(s, key)) != -1){
+            memcpy(lcloud_linedata(s, i), block, 256);
+            lcloud_hitline(s, i);
+            return (i);
+        }
+    } while ((i = lcloud_takeline(s, key, &ghostlist, admit)) == LC_LINE_RETRY);
+
+    //Otherwise fill the new line with the block (dropping any older compressed copy if the
+    // block is turned away)
+    if (i < 0){
+        if (i == LC_LINE_REJECTED){
+            lcloud_dropcopies(s, key);
+        }
+        return (i);
+    }
+    memcpy(lcloud_linedata(s, i), block, 256);
+    lcloud_fillline(s, i, key, ghostlist);
+    return (i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_freeline
+// Description  : Take a line off the policy and the index and give it to the free list
+//
+// Inputs       : s - the cache shard
+//                line - the line index
+// Outputs      : none
+
+static void lcloud_freeline( cacheshard *s, int line ) {
+    policy->remove(s, line);
+    lcloud_hashremove(s, line);
+    s->partsize[s->lrucache[line].part]--;
+    s->lrucache[line].dirty = 0;
+    s->lrucache[line].prefetched = 0;
+    s->lrucache[line].hashnext = s->linefree;
+    s->linefree = line;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_putcache
+// Description  : Put a value in the cache
+//
+// Inputs       : did - device number of block to insert
+//                sec - sector number of block to insert
+//                blk - block number of block to insert
+// Outputs      : 0 if succesfully inserted, -1 if failure
+
+int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    uint64_t key = lcloud_cachekey(did, sec, blk);
+    cacheshard *s = lcloud_shardof(key);
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    lcloud_waitload(s, key);
+    lcloud_sketchadd(s, key);
+    i = lcloud_putline(s, key, block, 1);
+    lcloud_mrcaccess(s, key, 0);
+    lcloud_shmstore(s, key, block);
+    pthread_mutex_unlock(&s->lock);
+    return (i == -1 ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_pincache
+// Description  : Search the cache for a block and pin it so it is not evicted until unpinned
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+// Outputs      : pinned cache block if found (pointer), NULL if not
+
+char *lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    uint64_t key = lcloud_cachekey(did, sec, blk);
+    cacheshard *s = lcloud_shardof(key);
+    char *data = NULL;
+    int i;
+    uint64_t start = lcloud_clock();
+
+    pthread_mutex_lock(&s->lock);
+    lcloud_waitload(s, key);
+    if ((i = lcloud_lookupline(s, key)) != -1){
+        lcloud_hitline(s, i);
+        lcloud_countaccess(s, key, 1);
+        s->lrucache[i].pins++;
+        data = lcloud_linedata(s, i);
+    }
+    else{
+        lcloud_countaccess(s, key, 0);
+    }
+    lcloud_timelookup(s, start);
+    pthread_mutex_unlock(&s->lock);
+    return (data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_unpincache
+// Description  : Release a block pinned by lcloud_pincache or lcloud_getorloadcache
+//
+// Inputs       : block - the pointer the pin returned
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_unpincache( char *block ) {
+    int line, per, extra, j;
+    cacheshard *s;
+    int ret = -1;
+
+    //Make sure the pointer really is the start of a block in the slab
+    if (shards == NULL || block < cacheslab || block >= cacheslab + ((size_t)(cacheblocks + bypassblocks) << 8) ||
+        ((block - cacheslab) & 0xFF) != 0){
+        return( -1 );
+    }
+
+    //The bypass lines follow the cache lines, LC_BYPASS_LINES for each shard in order
+    line = (int)((block - cacheslab) >> 8);
+    if (line >= cacheblocks){
+        s = &shards[(line - cacheblocks) / LC_BYPASS_LINES];
+        line = (line - cacheblocks) % LC_BYPASS_LINES;
+        pthread_mutex_lock(&s->lock);
+        if (s->bypasspins[line] > 0){
+            s->bypasspins[line]--;
+            ret = 0;
+        }
+        pthread_mutex_unlock(&s->lock);
+        return (ret);
+    }
+
+    //The shards hold the slab in order, the first (cacheblocks % shardcount) of them one line more
+    per = cacheblocks / shardcount;
+    extra = cacheblocks % shardcount;
+    j = (line < extra * (per + 1)) ? line / (per + 1) : extra + (line - extra * (per + 1)) / per;
+    s = &shards[j];
+
+    pthread_mutex_lock(&s->lock);
+    line -= s->slabbase;
+    if (s->lrucache[line].pins > 0){
+        s->lrucache[line].pins--;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_bypassline
+// Description  : Find an unpinned bypass line of a shard for a miss the admission filter turned away
+//
+// Inputs       : s - the cache shard
+// Outputs      : the bypass line number, -1 if every one is pinned
+
+static int lcloud_bypassline( cacheshard *s ) {
+    for (int b=0; s->bypass != NULL && b<LC_BYPASS_LINES; b++){
+        if (s->bypasspins[b] == 0){
+            return (b);
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_bypassfind
+// Description  : Find a bypass line another thread is loading a block into
+//
+// Inputs       : s - the cache shard
+//                key - the packed device/sector/block key
+// Outputs      : the bypass line number, -1 if the block is not being loaded into one
+
+static int lcloud_bypassfind( cacheshard *s, uint64_t key ) {
+    for (int b=0; s->bypass != NULL && b<LC_BYPASS_LINES; b++){
+        if (s->bypassloading[b] && s->bypasskeys[b] == key + 1){
+            return (b);
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_getorloadcache
+// Description  : Look up a block with one probe, on a miss call the loader to read it
+//                straight into a cache line. The block is returned pinned either way.
+//                The shard is unlocked while the loader runs, and threads that miss on
+//                the same block meanwhile wait for that load rather than starting another.
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+//                loader - function that reads the block into the line, returns 0 on success
+//                arg - passed through to the loader
+// Outputs      : pinned cache block (pointer), NULL if failure
+
+char *lcloud_getorloadcache( LcDeviceId did, uint16_t sec, uint16_t blk, LcCacheLoader loader, void *arg ) {
+    uint64_t key = lcloud_cachekey(did, sec, blk);
+    cacheshard *s = lcloud_shardof(key);
+    char *data = NULL;
+    int i, b, ghostlist, failed, missed = 0;
+    uint64_t start = lcloud_clock();
+
+    pthread_mutex_lock(&s->lock);
+    do {
+        if (lcloud_waitload(s, key)){
+            s->coalesced++;
+        }
+
+        //On a hit just pin the line (a miss that found it there after a victim was written back
+        // is still counted as a miss)
+        if ((i = lcloud_lookupline(s, key)) != -1){
+            lcloud_hitline(s, i);
+            if (!missed){
+                lcloud_countaccess(s, key, 1);
+            }
+            s->lrucache[i].pins++;
+            data = lcloud_linedata(s, i);
+        }
+        else if ((b = lcloud_bypassfind(s, key)) != -1){
+            //Another thread is reading the block into a bypass line, pin it and share that load's result
+            if (!missed){
+                lcloud_countaccess(s, key, 0);
+            }
+            s->coalesced++;
+            s->bypasspins[b]++;
+            while (s->bypassloading[b]){
+                pthread_cond_wait(&s->loaded, &s->lock);
+            }
+            if (s->bypasskeys[b] == key + 1){
+                data = s->bypass + (b << 8);
+            }
+            else{
+                s->bypasspins[b]--;
+            }
+        }
+        else{
+            if (!missed){
+                lcloud_countaccess(s, key, 0);
+                missed = 1;
+            }
+
+            //If the admission filter turns the block away, read it into a free bypass line (taking a
+            // line after all if they are all pinned)
+            i = lcloud_takeline(s, key, &ghostlist, 1);
+            if (i == LC_LINE_REJECTED && (b = lcloud_bypassline(s)) != -1){
+                s->bypasspins[b]++;
+                s->bypasskeys[b] = key + 1;
+                s->bypassloading[b] = 1;
+                pthread_mutex_unlock(&s->lock);
+                failed = loader(did, sec, blk, s->bypass + (b << 8), arg);
+                pthread_mutex_lock(&s->lock);
+                s->bypassloading[b] = 0;
+                if (failed){
+                    s->bypasskeys[b] = 0;
+                    s->bypasspins[b]--;
+                }
+                else{
+                    data = s->bypass + (b << 8);
+                    lcloud_shmstore(s, key, data);
+                }
+                pthread_cond_broadcast(&s->loaded);
+            }
+            else{
+                if (i == LC_LINE_REJECTED){
+                    i = lcloud_takeline(s, key, &ghostlist, 0);
+                }
+
+                //On a miss index a fresh line as loading (pinned, so it is not evicted) and load the block
+                // into it with the shard unlocked, freeing the line again if the load fails
+                if (i >= 0){
+                    lcloud_fillline(s, i, key, ghostlist);
+                    s->lrucache[i].pins++;
+                    s->lrucache[i].loading = 1;
+                    pthread_mutex_unlock(&s->lock);
+                    failed = loader(did, sec, blk, lcloud_linedata(s, i), arg);
+                    pthread_mutex_lock(&s->lock);
+                    s->lrucache[i].loading = 0;
+                    if (failed){
+                        s->lrucache[i].pins--;
+                        lcloud_freeline(s, i);
+                    }
+                    else{
+                        data = lcloud_linedata(s, i);
+                        lcloud_shmstore(s, key, data);
+                    }
+                    pthread_cond_broadcast(&s->loaded);
+                }
+            }
+        }
+
+        //Taking a line may have unlocked the shard to write back a victim, if so look again
+    } while (i == LC_LINE_RETRY);
+    lcloud_timelookup(s, start);
+    pthread_mutex_unlock(&s->lock);
+    return (data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_writecache
+// Description  : Write a block through the cache. In write-back mode the block is held as a
+//                dirty line and written when evicted or flushed, otherwise it goes straight to
+//                the device as well. Either way it is published to the shared memory tier, but
+//                copies other processes hold in their own lines are not invalidated.
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+//                block - the 256 byte block to write
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_writecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    uint64_t key = lcloud_cachekey(did, sec, blk);
+    cacheshard *s = lcloud_shardof(key);
+    int i, failed;
+
+    //Update (or add) the cached copy, written blocks skip the admission filter as they are
+    // usually read back soon
+    pthread_mutex_lock(&s->lock);
+    lcloud_waitload(s, key);
+    lcloud_mrcaccess(s, key, 0);
+    lcloud_sketchadd(s, key);
+    if ((i = lcloud_putline(s, key, block, 0)) >= 0 && lcloud_cachewriteback){
+        //Mark the line dirty, repeated writes to it merge here until it is flushed (saving a device write)
+        if (s->lrucache[i].dirty){
+            lcloud_count(s, did, currentfile, offsetof(LcCacheCounters, bytessaved), 256);
+        }
+        s->lrucache[i].dirty = 1;
+
+        //Publish the new block to the shared memory tier now (not at the flush) so a process
+        // that misses on it meanwhile does not read the old copy from the tier or the device
+        lcloud_shmstore(s, key, block);
+        pthread_mutex_unlock(&s->lock);
+        return (0);
+    }
+
+    //Write-through (or no line could be had), send the block to the device now with the shard
+    // unlocked, marking the line loading meanwhile so the block is not changed under the write
+    if (i >= 0){
+        s->lrucache[i].pins++;
+        s->lrucache[i].loading = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    failed = (cachewriter == NULL || cachewriter(did, sec, blk, block) != 0);
+    pthread_mutex_lock(&s->lock);
+    if (i >= 0){
+        s->lrucache[i].loading = 0;
+        s->lrucache[i].pins--;
+        pthread_cond_broadcast(&s->loaded);
+    }
+    if (failed){
+        pthread_mutex_unlock(&s->lock);
+        logMessage(LOG_ERROR_LEVEL, "Failed writing block [%d/%d/%d]", did, sec, blk);
+        return( -1 );
+    }
+    lcloud_count(s, did, currentfile, offsetof(LcCacheCounters, writes), 1);
+    lcloud_shmstore(s, key, block);
+    pthread_mutex_unlock(&s->lock);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushcache
+// Description  : Write every dirty line back to its device
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if any write failed
+
+int lcloud_flushcache( void ) {
+    int ret = 0;
+
+    for (int j=0; j<shardcount; j++){
+        pthread_mutex_lock(&shards[j].lock);
+        for (int i=0; i<shards[j].currentsize; i++){
+            //Wait out a load or write back of the line another thread has going
+            while (shards[j].lrucache[i].loading){
+                pthread_cond_wait(&shards[j].loaded, &shards[j].lock);
+            }
+            if (lcloud_flushline(&shards[j], i) != 0){
+                ret = -1;
+            }
+        }
+        pthread_mutex_unlock(&shards[j].lock);
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_dropcache
+// Description  : Drop a block from the cache without writing it back (e.g. its contents are being discarded)
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+// Outputs      : 0 if dropped or not cached, -1 if the block is pinned
+
+int lcloud_dropcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    uint64_t key = lcloud_cachekey(did, sec, blk);
+    cacheshard *s = lcloud_shardof(key);
+    int i, ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+    lcloud_waitload(s, key);
+    if ((i = lcloud_findline(s, key)) != -1){
+        if (s->lrucache[i].pins > 0){
+            ret = -1;
+        }
+        else{
+            lcloud_freeline(s, i);
+        }
+    }
+    lcloud_dropcopies(s, key);
+    lcloud_shmdrop(key);
+    pthread_mutex_unlock(&s->lock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_evictcache
+// Description  : Write a block back if it is dirty and drop it from the cache (it will not be
+//                used again soon, so its line is better spent on another block)
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+// Outputs      : 0 if dropped or not cached, 1 if kept because it is pinned, -1 if the write back failed
+
+int lcloud_evictcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    uint64_t key = lcloud_cachekey(did, sec, blk);
+    cacheshard *s = lcloud_shardof(key);
+    int i, ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+    lcloud_waitload(s, key);
+    if ((i = lcloud_findline(s, key)) != -1){
+        if (s->lrucache[i].pins > 0){
+            ret = 1;
+        }
+        else if (lcloud_flushline(s, i) != 0){
+            ret = -1;
+        }
+        else{
+            lcloud_freeline(s, i);
+        }
+    }
+    if (ret == 0){
+        lcloud_dropcopies(s, key);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_incache
+// Description  : Check whether a block is cached, without counting an access or telling the policy
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+// Outputs      : 1 if cached, 0 if not
+
+int lcloud_incache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+    uint64_t key = lcloud_cachekey(did, sec, blk);
+    cacheshard *s = lcloud_shardof(key);
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    i = (lcloud_findline(s, key) != -1 || lcloud_zfind(s, key) != -1 || lcloud_l2find(s, key) != -1 || lcloud_shmfind(key));
+    pthread_mutex_unlock(&s->lock);
+    return (i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_peekcache
+// Description  : Copy a block out of the cache for a read that goes around it, from its line or
+//                any tier, without bringing it up into a line, counting an access or telling the
+//                policy (the read leaves the cache as it found it)
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+//                block - buffer for the 256 byte block
+// Outputs      : 0 if the block was cached and copied, -1 if not
+
+int lcloud_peekcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    uint64_t key = lcloud_cachekey(did, sec, blk);
+    cacheshard *s = lcloud_shardof(key);
+    int i, ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+    lcloud_waitload(s, key);
+    if ((i = lcloud_findline(s, key)) != -1){
+        memcpy(block, lcloud_linedata(s, i), 256);
+    }
+    else if ((i = lcloud_zfind(s, key)) != -1){
+        lcloud_zdecompress(s->zentries[i].data, block);
+    }
+    else if ((i = lcloud_l2find(s, key)) != -1){
+        memcpy(block, s->l2data + ((size_t)i << 8), 256);
+    }
+    else{
+        ret = lcloud_shmload(key, block);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_prefetchcache
+// Description  : Put a block read ahead of need in the cache. A cached copy (which may be
+//                newer, or dirty) is left alone, and the line is marked so its first use
+//                or its eviction unused is counted.
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+//                block - the 256 byte block read from the device
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_prefetchcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    uint64_t key = lcloud_cachekey(did, sec, blk);
+    cacheshard *s = lcloud_shardof(key);
+    int i, ghostlist, ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+    do {
+        if (lcloud_findline(s, key) != -1 || lcloud_zfind(s, key) != -1 || lcloud_l2find(s, key) != -1){
+            pthread_mutex_unlock(&s->lock);
+            return (0);
+        }
+
+        //Taking a line may unlock the shard to write back a victim, if so look again
+    } while ((i = lcloud_takeline(s, key, &ghostlist, 0)) == LC_LINE_RETRY);
+    if (i == -1){
+        ret = -1;
+    }
+    else{
+        memcpy(lcloud_linedata(s, i), block, 256);
+        lcloud_fillline(s, i, key, ghostlist);
+        s->lrucache[i].prefetched = 1;
+        s->prefetches++;
+        lcloud_shmstore(s, key, block);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_prefetchstats
+// Description  : Get the readahead counters, used to size the readahead window
+//
+// Inputs       : used - set to the number of prefetched blocks used so far
+//                wasted - set to the number evicted without being used
+// Outputs      : none
+
+void lcloud_prefetchstats( int *used, int *wasted ) {
+    *used = 0;
+    *wasted = 0;
+    for (int j=0; j<shardcount; j++){
+        pthread_mutex_lock(&shards[j].lock);
+        *used += shards[j].prefetchhits;
+        *wasted += shards[j].prefetchwasted;
+        pthread_mutex_unlock(&shards[j].lock);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachewriter
+// Description  : Set the function the cache uses to write blocks to the device
+//
+// Inputs       : writer - the write function
+// Outputs      : none
+
+void lcloud_setcachewriter( LcCacheWriter writer ) {
+    cachewriter = writer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachedevices
+// Description  : Describe the devices the cached blocks come from, their ids and geometry, so
+//                a snapshot saved from a different set of devices is not loaded
+//
+// Inputs       : devices - the devices
+//                count - the number of devices
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcachedevices( const LcCacheDevice *devices, int count ) {
+    if (count < 0 || count > LC_CACHE_MAXDEVICES){
+        logMessage(LOG_ERROR_LEVEL, "Cannot describe %d devices to the cache (at most %d)", count, LC_CACHE_MAXDEVICES);
+        return( -1 );
+    }
+    memcpy(cachedevices, devices, sizeof(LcCacheDevice) * count);
+    cachedevicecount = count;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachequota
+// Description  : Set the least and most blocks a partition should hold, eviction takes from
+//                partitions over their max first and leaves those under their min alone
+//
+// Inputs       : part - the partition number
+//                minblocks - blocks the partition keeps before others lose theirs
+//                maxblocks - most blocks the partition holds before it evicts its own, 0 for no limit
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcachequota( int part, int minblocks, int maxblocks ) {
+    if (part < 0 || part >= LC_CACHE_MAXPARTS || minblocks < 0 || maxblocks < 0 ||
+        (maxblocks > 0 && maxblocks < minblocks)){
+        logMessage(LOG_ERROR_LEVEL, "Bad cache quota for partition %d (min %d, max %d)", part, minblocks, maxblocks);
+        return( -1 );
+    }
+    partmin[part] = minblocks;
+    partmax[part] = maxblocks;
+    partitioned = 1;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setdevicepartition
+// Description  : Put a device's blocks in a partition (all start in partition 0)
+//
+// Inputs       : did - the device
+//                part - the partition number
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setdevicepartition( LcDeviceId did, int part ) {
+    if (part < 0 || part >= LC_CACHE_MAXPARTS){
+        logMessage(LOG_ERROR_LEVEL, "Bad cache partition %d for device %d", part, did);
+        return( -1 );
+    }
+    devpart[did & 0xFF] = (uint8_t)part;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_usecachepartition
+// Description  : Put the blocks the calling thread caches from now on in a partition,
+//                overriding the device's (used by the filesystem for per-file partitions)
+//
+// Inputs       : part - the partition number, -1 to go back to the device's
+// Outputs      : none
+
+void lcloud_usecachepartition( int part ) {
+    currentpart = (part >= 0 && part < LC_CACHE_MAXPARTS) ? part : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_usecachefile
+// Description  : Count the cache accesses the calling thread makes from now on for a file
+//
+// Inputs       : file - the file handle, -1 to count them for no file
+// Outputs      : none
+
+void lcloud_usecachefile( int file ) {
+    currentfile = (file >= 0 && file < LC_CACHE_STATFILES) ? file : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_addcounters
+// Description  : Add one set of event counters into another
+//
+// Inputs       : to - the counters to add to
+//                from - the counters to add
+// Outputs      : none
+
+static void lcloud_addcounters( LcCacheCounters *to, const LcCacheCounters *from ) {
+    to->hits += from->hits;
+    to->misses += from->misses;
+    to->insertions += from->insertions;
+    to->evictions += from->evictions;
+    to->flushes += from->flushes;
+    to->writes += from->writes;
+    to->bytessaved += from->bytessaved;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachestats
+// Description  : Get the cache statistics so far, added up over the shards (each shard is
+//                locked while it is read, so they can be taken while the cache is in use)
+//
+// Inputs       : stats - the statistics to fill in
+// Outputs      : 0 if successful, -1 if the cache is not initialized
+
+int lcloud_cachestats( LcCacheStats *stats ) {
+    memset(stats, 0, sizeof(*stats));
+    if (shards == NULL){
+        return( -1 );
+    }
+
+    stats->blocks = cacheblocks;
+    stats->arena = arenakind;
+    for (int j=0; j<shardcount; j++){
+        cacheshard *s = &shards[j];
+
+        pthread_mutex_lock(&s->lock);
+        for (int p=0; p<LC_CACHE_MAXPARTS; p++){
+            stats->used += s->partsize[p];
+        }
+        lcloud_addcounters(&stats->total, &s->total);
+        for (int d=0; d<LC_CACHE_STATDEVICES; d++){
+            lcloud_addcounters(&stats->device[d], &s->devstats[d]);
+        }
+        for (int f=0; s->filestats != NULL && f<LC_CACHE_STATFILES; f++){
+            lcloud_addcounters(&stats->file[f], &s->filestats[f]);
+        }
+        stats->prefetches += s->prefetches;
+        stats->prefetchhits += s->prefetchhits;
+        stats->prefetchwasted += s->prefetchwasted;
+        stats->coalesced += s->coalesced;
+        stats->zhits += s->zhits;
+        stats->l2hits += s->l2hits;
+        stats->shmhits += s->shmhits;
+        stats->admitted += s->admitted;
+        stats->rejected += s->rejected;
+        for (int b=0; b<LC_CACHE_LATBUCKETS; b++){
+            stats->latency[b] += s->latency[b];
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return( 0 );
+}
 
-}cache;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachelatency
+// Description  : Get a lookup latency percentile from the statistics' histogram, as the top
+//                of the histogram slot it falls in
+//
+// Inputs       : stats - the statistics
+//                fraction - the percentile as a fraction (0.5 for the median)
+// Outputs      : the latency in nanoseconds, 0 if there were no lookups
 
-//Create an array of cache lines 
-cache lrucache[LC_CACHE_MAXBLOCKS];
-//Variable to keep track of the size of the cache
-int currentsize;
-//Variables to count the amount of hits and misses
-int hits, misses;
+double lcloud_cachelatency( const LcCacheStats *stats, double fraction ) {
+    uint64_t lookups = 0, seen = 0;
+
+    for (int b=0; b<LC_CACHE_LATBUCKETS; b++){
+        lookups += stats->latency[b];
+    }
+    for (int b=0; b<LC_CACHE_LATBUCKETS && lookups > 0; b++){
+        seen += stats->latency[b];
+        if ((double)seen >= fraction * (double)lookups){
+            return ((double)(2ULL << b));
+        }
+    }
+    return (0.0);
+}
 
-//Variable to keep track of when variables were accessed
-int currenttime = 0;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setbits
+// Description  : Size the line index of a shard, keeping it no more than three quarters full
+//
+// Inputs       : lines - the number of lines in the shard
+// Outputs      : log2 of the number of sets
 
-//Create a pointer for the cache
-cache *ptr = &lrucache;
+static int lcloud_setbits( int lines ) {
+    int bits = 1;
 
-int smallesttime = 0;
+    while ((1 << bits) * LC_SET_WAYS * 3 < 4 * lines){
+        bits++;
+    }
+    return (bits);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_getcache
-// Description  : Search the cache for a block 
+// Function     : lcloud_arenaopen
+// Description  : Map the arena the slab and line metadata are carved from, on reserved 2 MB
+//                huge pages if the system has them, otherwise 2 MB aligned and marked for
+//                transparent huge pages. A cache under one huge page stays on the heap.
 //
-// Inputs       : did - device number of block to find
-//                sec - sector number of block to find
-//                blk - block number of block to find
-// Outputs      : cache block if found (pointer), NULL if not or failure
+// Inputs       : bytes - the memory the slab and metadata need
+// Outputs      : 0 if successful (or the heap is used), -1 if failure
+
+static int lcloud_arenaopen( size_t bytes ) {
+    char *map;
+    size_t lead;
+
+    arenaused = 0;
+    arenakind = LC_CACHE_HEAP;
+    if (!lcloud_cachehugepages || bytes < LC_HUGE_PAGE){
+        return( 0 );
+    }
+    arenabytes = (bytes + LC_HUGE_PAGE - 1) & ~((size_t)LC_HUGE_PAGE - 1);
+
+    //Reserved huge pages are the surest, but are usually not set aside (vm.nr_hugepages)
+#if defined(MAP_HUGETLB)
+    map = (char *)mmap(NULL, arenabytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED){
+        cachearena = map;
+        arenakind = LC_CACHE_HUGETLB;
+        return( 0 );
+    }
+#endif
+
+    //Otherwise map a huge page extra, trim it to a 2 MB boundary and ask for transparent huge pages
+    map = (char *)mmap(NULL, arenabytes + LC_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED){
+        logMessage(LOG_ERROR_LEVEL, "Unable to map a cache arena of %lu bytes", (unsigned long)arenabytes);
+        return( -1 );
+    }
+    lead = (LC_HUGE_PAGE - ((uintptr_t)map & (LC_HUGE_PAGE - 1))) & (LC_HUGE_PAGE - 1);
+    if (lead > 0){
+        munmap(map, lead);
+    }
+    munmap(map + lead + arenabytes, LC_HUGE_PAGE - lead);
+    cachearena = map + lead;
+#if defined(MADV_HUGEPAGE)
+    madvise(cachearena, arenabytes, MADV_HUGEPAGE);
+#endif
+    arenakind = LC_CACHE_THP;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_arenaalloc
+// Description  : Hand out 64 byte aligned memory from the arena, or the heap if there is none
+//
+// Inputs       : bytes - the size wanted
+// Outputs      : the memory, NULL if failure
+
+static void *lcloud_arenaalloc( size_t bytes ) {
+    void *mem;
+
+    bytes = (bytes + 63) & ~(size_t)63;
+    if (cachearena == NULL){
+        return (aligned_alloc(64, bytes));
+    }
+    if (arenaused + bytes > arenabytes){
+        return (NULL);
+    }
+    mem = cachearena + arenaused;
+    arenaused += bytes;
+    return (mem);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_arenafree
+// Description  : Give back memory from lcloud_arenaalloc (arena memory goes when it is unmapped)
+//
+// Inputs       : mem - the memory
+// Outputs      : none
+
+static void lcloud_arenafree( void *mem ) {
+    if (cachearena == NULL){
+        free(mem);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_arenaclose
+// Description  : Unmap the arena, if the cache has one
+//
+// Inputs       : none
+// Outputs      : none
+
+static void lcloud_arenaclose( void ) {
+    if (cachearena != NULL){
+        munmap(cachearena, arenabytes);
+        cachearena = NULL;
+    }
+    arenabytes = 0;
+    arenaused = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initshard
+// Description  : Allocate and reset one shard of the cache
+//
+// Inputs       : s - the cache shard
+//                index - the shard's position in the shard array
+//                maxblocks - the number of lines in the shard
+// Outputs      : 0 if successful, -1 if failure
+
+static int lcloud_initshard( cacheshard *s, int base, int maxblocks ) {
+    int useghosts = (lcloud_cachepolicy == LC_CACHE_2Q || lcloud_cachepolicy == LC_CACHE_ARC);
+    int useheap = (lcloud_cachepolicy == LC_CACHE_LFU);
+    double rate;
+
+    //Size the ghost hash index to at least twice the number of lines to keep the chains short,
+    // and the line index to keep it no more than three quarters full
+    s->hashbits = 1;
+    while ((1 << s->hashbits) < 2 * maxblocks){
+        s->hashbits++;
+    }
+    s->setbits = lcloud_setbits(maxblocks);
+
+    //Allocate the cache lines and line index (a set to a cache line) from the arena with the slab,
+    // plus the ghosts or heap for the policies that use them
+    s->blocks = cacheslab + ((size_t)base << 8);
+    s->slabbase = base;
+    s->lrucache = (cache *)lcloud_arenaalloc(sizeof(cache) * maxblocks);
+    s->sets = (lineset *)lcloud_arenaalloc(sizeof(lineset) * (1 << s->setbits));
+    if (useghosts){
+        s->ghosts = (ghost *)malloc(sizeof(ghost) * maxblocks);
+        s->ghostbuckets = (int *)malloc(sizeof(int) * (1 << s->hashbits));
+    }
+    if (useheap){
+        s->lfuheap = (int *)malloc(sizeof(int) * maxblocks);
+    }
+    if (s->lrucache == NULL || s->sets == NULL ||
+        (useghosts && (s->ghosts == NULL || s->ghostbuckets == NULL)) || (useheap && s->lfuheap == NULL)){
+        return( -1 );
+    }
+    s->maxsize = maxblocks;
+
+    //For each line of the cache, initialize the values to zero
+    s->currentsize = 0;
+    for (int i=0; i<maxblocks; i++){
+        s->lrucache[i].devid = 0;
+        s->lrucache[i].sector = 0;
+        s->lrucache[i].block = 0;
+        s->lrucache[i].key = 0;
+        s->lrucache[i].hashnext = -1;
+        s->lrucache[i].link.prev = -1;
+        s->lrucache[i].link.next = -1;
+        s->lrucache[i].list = -1;
+        s->lrucache[i].ref = 0;
+        s->lrucache[i].freq = 0;
+        s->lrucache[i].heappos = -1;
+        s->lrucache[i].stamp = 0;
+        s->lrucache[i].pins = 0;
+        s->lrucache[i].loading = 0;
+        s->lrucache[i].dirty = 0;
+        s->lrucache[i].prefetched = 0;
+        s->lrucache[i].part = 0;
+        s->lrucache[i].file = -1;
+    }
+
+    //Start with every way, hash bucket and list empty, and every ghost slot free
+    for (int set=0; set<(1 << s->setbits); set++){
+        memset(s->sets[set].tags, LC_TAG_PAD, sizeof(s->sets[set].tags));
+        memset(s->sets[set].tags, LC_TAG_EMPTY, LC_SET_WAYS);
+        for (int w=0; w<LC_SET_WAYS; w++){
+            s->sets[set].lines[w] = -1;
+        }
+    }
+    s->settombs = 0;
+    for (int b=0; b<(1 << s->hashbits) && useghosts; b++){
+        s->ghostbuckets[b] = -1;
+    }
+    for (int l=0; l<LC_LIST_COUNT; l++){
+        s->lists[l].head = -1;
+        s->lists[l].tail = -1;
+        s->lists[l].size = 0;
+    }
+    s->linefree = -1;
+    s->ghostfree = -1;
+    if (useghosts){
+        for (int g=maxblocks-1; g>=0; g--){
+            s->ghosts[g].link.prev = -1;
+            s->ghosts[g].link.next = s->ghostfree;
+            s->ghostfree = g;
+        }
+    }
+    s->clockhand = 0;
+    s->lfuheapsize = 0;
+    s->accesscount = 0;
+    s->arctarget = 0;
+    memset(&s->total, 0, sizeof(s->total));
+    memset(s->devstats, 0, sizeof(s->devstats));
+    memset(s->latency, 0, sizeof(s->latency));
+    if ((s->filestats = (LcCacheCounters *)calloc(LC_CACHE_STATFILES, sizeof(LcCacheCounters))) == NULL){
+        return( -1 );
+    }
+    s->prefetches = 0;
+    s->prefetchhits = 0;
+    s->prefetchwasted = 0;
+    s->coalesced = 0;
+    memset(s->bypasspins, 0, sizeof(s->bypasspins));
+    memset(s->bypasskeys, 0, sizeof(s->bypasskeys));
+    memset(s->bypassloading, 0, sizeof(s->bypassloading));
+    memset(s->partsize, 0, sizeof(s->partsize));
+    memset(s->parthits, 0, sizeof(s->parthits));
+    memset(s->partmisses, 0, sizeof(s->partmisses));
+    s->evictmask = LC_PART_ALL;
+
+    //Give the admission sketch a few counters a row for every line, halved every ten shard sizes of accesses
+    if (lcloud_cacheadmission){
+        s->sketchbits = 4;
+        while ((1 << s->sketchbits) < LC_SKETCH_WIDTH * maxblocks){
+            s->sketchbits++;
+        }
+        if ((s->sketch = (uint8_t *)calloc(LC_SKETCH_ROWS << s->sketchbits, 1)) == NULL){
+            return( -1 );
+        }
+        s->sketchperiod = LC_SKETCH_PERIOD * maxblocks;
+    }
 
-char *lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
-    
+    //Sample enough keys to see reuse out to 64 times the whole cache, spread over the shards,
+    // with a few extra so keys just past the end are not forgotten too soon
+    rate = (double)LC_MRC_SAMPLES / ((double)LC_MRC_MAXMULTIPLE * cacheblocks);
+    if (rate > 1.0){
+        rate = 1.0;
+    }
+    s->mrcsize = (int)(1.25 * LC_MRC_MAXMULTIPLE * cacheblocks * rate / shardcount) + 1;
+    s->mrcbits = 1;
+    while ((1 << s->mrcbits) < 2 * s->mrcsize){
+        s->mrcbits++;
+    }
+    s->mrctreesize = 4 * s->mrcsize;
+    s->mrcsamples = (mrcsample *)malloc(sizeof(mrcsample) * s->mrcsize);
+    s->mrcbuckets = (int *)malloc(sizeof(int) * (1 << s->mrcbits));
+    s->mrctree = (int *)calloc(s->mrctreesize, sizeof(int));
+    if (s->mrcsamples == NULL || s->mrcbuckets == NULL || s->mrctree == NULL){
+        return( -1 );
+    }
+    s->mrcthreshold = (uint32_t)(rate * 0x1000000);
+    s->mrcscale = shardcount / rate;
+    for (int b=0; b<(1 << s->mrcbits); b++){
+        s->mrcbuckets[b] = -1;
+    }
+    s->mrcfree = -1;
+    for (int m=s->mrcsize-1; m>=0; m--){
+        s->mrcsamples[m].link.prev = -1;
+        s->mrcsamples[m].link.next = s->mrcfree;
+        s->mrcfree = m;
+    }
+    s->mrclist.head = -1;
+    s->mrclist.tail = -1;
+    s->mrclist.size = 0;
+    s->mrctime = 0;
+    s->mrcaccesses = 0;
+
+    //Give the shard its part of the compressed tier, with enough entries for blocks compressed to 16 bytes
+    s->zlist.head = -1;
+    s->zlist.tail = -1;
+    s->zlist.size = 0;
+    s->zfree = -1;
+    s->zbytes = 0;
+    s->zhits = 0;
+    s->zstored = 0;
+    s->zevicted = 0;
+    s->zinbytes = 0;
+    if (lcloud_cachezbytes > 0){
+        s->zmaxbytes = lcloud_cachezbytes / shardcount;
+        s->zsize = s->zmaxbytes / ((int)sizeof(zentry) + 16) + 1;
+        s->zbits = 1;
+        while ((1 << s->zbits) < 2 * s->zsize){
+            s->zbits++;
+        }
+        s->zentries = (zentry *)malloc(sizeof(zentry) * s->zsize);
+        s->zbuckets = (int *)malloc(sizeof(int) * (1 << s->zbits));
+        if (s->zentries == NULL || s->zbuckets == NULL){
+            return( -1 );
+        }
+        for (int b=0; b<(1 << s->zbits); b++){
+            s->zbuckets[b] = -1;
+        }
+        for (int z=s->zsize-1; z>=0; z--){
+            s->zentries[z].data = NULL;
+            s->zentries[z].link.prev = -1;
+            s->zentries[z].link.next = s->zfree;
+            s->zfree = z;
+        }
+    }
 
-    //Loop through the cache to find the block we want
-    for (int i=0; i<currentsize; i++){
-        if (lrucache[i].devid == did && lrucache[i].sector == sec && lrucache[i].block == blk){
-            //If the specific block exists in the cache, return it's data and update time and hits
-            hits++;
-            return (lrucache[i].data);
+    //Give the shard its slots of the disk tier file
+    s->l2list.head = -1;
+    s->l2list.tail = -1;
+    s->l2list.size = 0;
+    s->l2free = -1;
+    s->l2hits = 0;
+    s->l2stored = 0;
+    s->l2evicted = 0;
+    s->shmhits = 0;
+    s->shmstored = 0;
+    if (s->l2size > 0){
+        s->l2bits = 1;
+        while ((1 << s->l2bits) < 2 * s->l2size){
+            s->l2bits++;
+        }
+        s->l2entries = (l2entry *)malloc(sizeof(l2entry) * s->l2size);
+        s->l2buckets = (int *)malloc(sizeof(int) * (1 << s->l2bits));
+        if (s->l2entries == NULL || s->l2buckets == NULL){
+            return( -1 );
         }
+        for (int b=0; b<(1 << s->l2bits); b++){
+            s->l2buckets[b] = -1;
+        }
+        for (int e=s->l2size-1; e>=0; e--){
+            s->l2entries[e].link.prev = -1;
+            s->l2entries[e].link.next = s->l2free;
+            s->l2free = e;
+        }
+    }
+
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stampcompare
+// Description  : qsort comparison putting snapshot lines in order of last use, oldest first
+//
+// Inputs       : a, b - pointers to the snapshot lines
+// Outputs      : negative, zero or positive like strcmp
+
+static int lcloud_stampcompare( const void *a, const void *b ) {
+    uint64_t x = ((const snapshotline *)a)->stamp, y = ((const snapshotline *)b)->stamp;
+
+    return ((x > y) - (x < y));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_fnv
+// Description  : Carry a snapshot checksum (FNV-1a) over some more bytes
+//
+// Inputs       : hash - the checksum so far
+//                data - the bytes
+//                len - the number of bytes
+// Outputs      : the new checksum
+
+static uint64_t lcloud_fnv( uint64_t hash, const void *data, size_t len ) {
+    const unsigned char *p = (const unsigned char *)data;
+
+    for (size_t i=0; i<len; i++){
+        hash = (hash ^ p[i]) * LC_FNV_PRIME;
     }
-    //If the block doesnt exist in the cache
-    misses++;
-    return( NULL );
+    return (hash);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_putcache
-// Description  : Put a value in the cache 
+// Function     : lcloud_savesnapshot
+// Description  : Write the clean cached blocks to the snapshot file, oldest use first
 //
-// Inputs       : did - device number of block to insert
-//                sec - sector number of block to insert
-//                blk - block number of block to insert
-// Outputs      : 0 if succesfully inserted, -1 if failure
+// Inputs       : path - the snapshot file
+// Outputs      : 0 if successful, -1 if failure
 
-int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
-    //If cache is not full yet
-    if (currentsize < LC_CACHE_MAXBLOCKS){
-        //Loop through the cache and see if its in there already
-        for (int i=0; i<currentsize; i++){
-            if (lrucache[i].devid == did && lrucache[i].sector == sec && lrucache[i].block == blk){
-                //If the block was already in the cache, repace the data and timestamp
-                memcpy(lrucache[i].data, block, 256);
-                lrucache[i].time = currenttime;
-                currenttime++;
-
-                return (0);
-            }
-        }
-        //If it's not, then just add it to the end
-        memcpy(lrucache[currentsize].data, block, 256);
-        lrucache[currentsize].devid = did;
-        lrucache[currentsize].sector = sec;
-        lrucache[currentsize].block = blk;
-        lrucache[currentsize].time = currenttime;
-        currenttime++;
-        currentsize++;
-        return(0);
-    }
-    //If the cache is full
-    //Loop through the cache to see if the block is already in
-    for (int j=0; j< LC_CACHE_MAXBLOCKS; j++){
-        if (lrucache[j].devid == did && lrucache[j].sector == sec && lrucache[j].block == blk){
-            
-            //If the block was already in the cache, replace the data and timestamp
-            memcpy(lrucache[j].data, block, 256);
-            lrucache[j].time = currenttime;
-            currenttime++;
-            return (0);
+static int lcloud_savesnapshot( const char *path ) {
+    snapshotheader header;
+    snapshotline *lines;
+    FILE *fp;
+    int count = 0, ok;
+
+    //Gather every line holding a block, dirty ones could not be flushed so they are not kept
+    if ((lines = (snapshotline *)malloc(sizeof(snapshotline) * (cacheblocks > 0 ? cacheblocks : 1))) == NULL){
+        return( -1 );
+    }
+    for (int j=0; j<shardcount; j++){
+        for (int i=0; i<shards[j].maxsize; i++){
+            if (!shards[j].lrucache[i].dirty && lcloud_findline(&shards[j], shards[j].lrucache[i].key) == i){
+                lines[count].stamp = shards[j].lrucache[i].stamp;
+                lines[count].key = shards[j].lrucache[i].key;
+                lines[count].data = lcloud_linedata(&shards[j], i);
+                count++;
+            }
         }
     }
-    //If the block wasnt found in the cache, evict the lru block and replace it with the new one
-    
-    //Do this by finding the smallest time and replacing it's block
-    for (int y=1; y< LC_CACHE_MAXBLOCKS; y++){
-        if (lrucache[y].time == smallesttime){
-            lrucache[y].devid = did;
-            lrucache[y].sector = sec;
-            lrucache[y].block = blk;
-            smallesttime++;
-            lrucache[y].time = currenttime;
-            memcpy(lrucache[y].data, block, 256);
-            currenttime++;
-            return (0);
+    qsort(lines, count, sizeof(snapshotline), lcloud_stampcompare);
+    header.checksum = lcloud_fnv(LC_FNV_OFFSET, cachedevices, sizeof(LcCacheDevice) * cachedevicecount);
+    for (int i=0; i<count; i++){
+        header.checksum = lcloud_fnv(lcloud_fnv(header.checksum, &lines[i].key, sizeof(uint64_t)), lines[i].data, 256);
+    }
+
+    //Write the header, the devices, then the key and data of each line
+    if ((fp = fopen(path, "wb")) == NULL){
+        logMessage(LOG_ERROR_LEVEL, "Unable to create cache snapshot [%s]", path);
+        free(lines);
+        return( -1 );
+    }
+    header.magic = LC_SNAPSHOT_MAGIC;
+    header.version = LC_SNAPSHOT_VERSION;
+    header.blocksize = 256;
+    header.count = count;
+    header.devices = cachedevicecount;
+    header.pad = 0;
+    ok = (fwrite(&header, sizeof(header), 1, fp) == 1 &&
+          fwrite(cachedevices, sizeof(LcCacheDevice), cachedevicecount, fp) == (size_t)cachedevicecount);
+    for (int i=0; ok && i<count; i++){
+        ok = (fwrite(&lines[i].key, sizeof(uint64_t), 1, fp) == 1 && fwrite(lines[i].data, 256, 1, fp) == 1);
+    }
+    free(lines);
+    if (fclose(fp) != 0 || !ok){
+        logMessage(LOG_ERROR_LEVEL, "Unable to write cache snapshot [%s]", path);
+        return( -1 );
+    }
+    logMessage(LcDriverLLevel, "Saved %d cached blocks to [%s]", count, path);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_loadsnapshot
+// Description  : Fill the cache from a snapshot file, a missing file leaves it cold. Nothing is
+//                loaded unless the file was saved from the same devices (ids and geometry) and
+//                its checksum matches, a stale or foreign snapshot would hand out wrong blocks.
+//
+// Inputs       : path - the snapshot file
+// Outputs      : number of blocks loaded, -1 if the file is bad or of other devices
+
+static int lcloud_loadsnapshot( const char *path ) {
+    snapshotheader header;
+    LcCacheDevice devices[LC_CACHE_MAXDEVICES];
+    uint64_t key, checksum;
+    char block[256];
+    cacheshard *s;
+    FILE *fp;
+    long records;
+    int loaded = 0;
+
+    if ((fp = fopen(path, "rb")) == NULL){
+        return( 0 );
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != LC_SNAPSHOT_MAGIC ||
+        header.version != LC_SNAPSHOT_VERSION || header.blocksize != 256 || header.devices > LC_CACHE_MAXDEVICES ||
+        fread(devices, sizeof(LcCacheDevice), header.devices, fp) != header.devices){
+        logMessage(LOG_ERROR_LEVEL, "Bad cache snapshot [%s], starting cold", path);
+        fclose(fp);
+        return( -1 );
+    }
+    if ((int)header.devices != cachedevicecount || memcmp(devices, cachedevices, sizeof(LcCacheDevice) * cachedevicecount) != 0){
+        logMessage(LOG_ERROR_LEVEL, "Cache snapshot [%s] is of other devices, starting cold", path);
+        fclose(fp);
+        return( -1 );
+    }
+
+    //Check the whole file before putting any of it in the cache
+    records = ftell(fp);
+    checksum = lcloud_fnv(LC_FNV_OFFSET, devices, sizeof(LcCacheDevice) * header.devices);
+    for (uint32_t n=0; n<header.count; n++){
+        if (fread(&key, sizeof(uint64_t), 1, fp) != 1 || fread(block, 256, 1, fp) != 1){
+            logMessage(LOG_ERROR_LEVEL, "Truncated cache snapshot [%s], starting cold", path);
+            fclose(fp);
+            return( -1 );
+        }
+        checksum = lcloud_fnv(lcloud_fnv(checksum, &key, sizeof(uint64_t)), block, 256);
+    }
+    if (checksum != header.checksum || fseek(fp, records, SEEK_SET) != 0){
+        logMessage(LOG_ERROR_LEVEL, "Cache snapshot [%s] does not match its checksum, starting cold", path);
+        fclose(fp);
+        return( -1 );
+    }
+
+    //Put the blocks back oldest first, so a smaller cache keeps the most recently used ones
+    for (uint32_t n=0; n<header.count; n++){
+        if (fread(&key, sizeof(uint64_t), 1, fp) != 1 || fread(block, 256, 1, fp) != 1){
+            logMessage(LOG_ERROR_LEVEL, "Truncated cache snapshot [%s]", path);
+            break;
+        }
+        s = lcloud_shardof(key);
+        if (lcloud_putline(s, key, block, 0) >= 0){
+            loaded++;
+        }
+    }
+    fclose(fp);
+    logMessage(LcDriverLLevel, "Loaded %d cached blocks from [%s]", loaded, path);
+    return( loaded );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_l2open
+// Description  : Create the disk tier file and map it into memory. The file is unlinked once
+//                mapped, the blocks only mean anything to this run, and its space is given back
+//                when the mapping goes away however the program ends.
+//
+// Inputs       : path - the file to create (on a local disk)
+//                blocks - the size of the disk tier in blocks
+// Outputs      : 0 if successful, -1 if failure
+
+static int lcloud_l2open( const char *path, int blocks ) {
+    int fd;
+
+    if (blocks < shardcount){
+        logMessage(LOG_ERROR_LEVEL, "Disk tier of %d blocks is too small for %d shards", blocks, shardcount);
+        return( -1 );
+    }
+    l2mapbytes = (size_t)blocks << 8;
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1){
+        logMessage(LOG_ERROR_LEVEL, "Unable to create disk tier file [%s]", path);
+        return( -1 );
+    }
+    if (ftruncate(fd, (off_t)l2mapbytes) != 0 ||
+        (l2map = (char *)mmap(NULL, l2mapbytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        logMessage(LOG_ERROR_LEVEL, "Unable to map disk tier file [%s] of %d blocks", path, blocks);
+        l2map = NULL;
+        close(fd);
+        unlink(path);
+        return( -1 );
+    }
+    close(fd);
+    unlink(path);
+
+    //Hits land anywhere in the file, so do not read ahead around them
+    madvise(l2map, l2mapbytes, MADV_RANDOM);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmguard
+// Description  : Take (or release) the lock opens and closes of the shared memory tier take
+//                turns on, a small object next to the segment that is never removed
+//
+// Inputs       : name - the POSIX shared memory object name of the tier
+//                fd - the guard's descriptor to release, -1 to take the lock
+// Outputs      : the guard's descriptor (locked) when taking it, -1 if failure
+
+static int lcloud_shmguard( const char *name, int fd ) {
+    char guard[256];
+
+    if (fd != -1){
+        flock(fd, LOCK_UN);
+        close(fd);
+        return( -1 );
+    }
+    if (snprintf(guard, sizeof(guard), "%s%s", name, LC_SHM_GUARD) >= (int)sizeof(guard) ||
+        (fd = shm_open(guard, O_RDWR | O_CREAT, 0600)) == -1){
+        logMessage(LOG_ERROR_LEVEL, "Unable to open the lock of shared memory tier [%s]", name);
+        return( -1 );
+    }
+    while (flock(fd, LOCK_EX) != 0){
+        if (errno != EINTR){
+            logMessage(LOG_ERROR_LEVEL, "Unable to lock shared memory tier [%s]", name);
+            close(fd);
+            return( -1 );
+        }
+    }
+    return (fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmopen
+// Description  : Map the shared memory tier, creating and sizing the segment if no other
+//                process on the host is using one. Opens and closes take turns on a guard
+//                lock, so an opener never sees a segment half set up or one being removed.
+//                A segment nobody holds a flock on was left by a process that died without
+//                closing it, its blocks may be stale so it is removed and made afresh.
+//
+// Inputs       : name - the POSIX shared memory object name (e.g. "/lcloud")
+//                blocks - the size of the tier in blocks if this process creates it
+// Outputs      : 0 if successful, -1 if failure
+
+static int lcloud_shmopen( const char *name, int blocks ) {
+    struct stat st;
+    pthread_mutexattr_t attr;
+    uint32_t sets = 1;
+    int fd, guard, created = 0;
+
+    //Round the sets up to a power of two so a key's set is a mask of its hash
+    while ((uint64_t)sets * LC_SHM_WAYS < (uint64_t)blocks && sets < (1u << 31)){
+        sets <<= 1;
+    }
+    if ((guard = lcloud_shmguard(name, -1)) == -1){
+        return( -1 );
+    }
+
+    //Use a segment other processes hold, removing one that nobody does
+    if ((fd = shm_open(name, O_RDWR, 0600)) != -1 && flock(fd, LOCK_EX | LOCK_NB) == 0){
+        logMessage(LOG_ERROR_LEVEL, "Removing stale shared memory tier [%s] (its processes ended without closing it)", name);
+        close(fd);
+        shm_unlink(name);
+        fd = -1;
+    }
+
+    //Otherwise create it, the creator sizes the segment (zero filled, so every slot starts empty)
+    if (fd == -1){
+        if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1){
+            logMessage(LOG_ERROR_LEVEL, "Unable to open shared memory tier [%s]", name);
+            lcloud_shmguard(name, guard);
+            return( -1 );
         }
+        created = 1;
+        if (ftruncate(fd, (off_t)(sizeof(shmheader) + (size_t)sets * sizeof(shmset))) != 0){
+            logMessage(LOG_ERROR_LEVEL, "Unable to size shared memory tier [%s] for %d blocks", name, blocks);
+            close(fd);
+            shm_unlink(name);
+            lcloud_shmguard(name, guard);
+            return( -1 );
+        }
+    }
+
+    //Map it, taking the size it was given, and hold a shared flock for as long as it is mapped
+    shmmapbytes = (fstat(fd, &st) == 0) ? (size_t)st.st_size : 0;
+    if (shmmapbytes < sizeof(shmheader) || flock(fd, LOCK_SH) != 0 ||
+        (shmmap = (shmheader *)mmap(NULL, shmmapbytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        logMessage(LOG_ERROR_LEVEL, "Unable to map shared memory tier [%s]", name);
+        shmmap = NULL;
+        close(fd);
+        if (created){
+            shm_unlink(name);
+        }
+        lcloud_shmguard(name, guard);
+        return( -1 );
+    }
+
+    //The creator sets up the sets' locks and publishes the layout, anyone else checks it is one
+    // this build understands
+    if (created){
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        for (uint32_t i=0; i<sets; i++){
+            pthread_mutex_init(&((shmset *)(shmmap + 1))[i].lock, &attr);
+        }
+        pthread_mutexattr_destroy(&attr);
+        shmmap->version = LC_SHM_VERSION;
+        shmmap->sets = sets;
+        __atomic_store_n(&shmmap->magic, LC_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    if (__atomic_load_n(&shmmap->magic, __ATOMIC_ACQUIRE) != LC_SHM_MAGIC || shmmap->version != LC_SHM_VERSION ||
+        (shmmap->sets & (shmmap->sets - 1)) != 0 || shmmapbytes < sizeof(shmheader) + (size_t)shmmap->sets * sizeof(shmset)){
+        logMessage(LOG_ERROR_LEVEL, "Shared memory tier [%s] is not set up or from another version", name);
+        munmap(shmmap, shmmapbytes);
+        shmmap = NULL;
+        close(fd);
+        lcloud_shmguard(name, guard);
+        return( -1 );
     }
-    
-    
+    shmsets = (shmset *)(shmmap + 1);
+    shmmask = shmmap->sets - 1;
+    shmfd = fd;
+    shmpid = getpid();
+    lcloud_shmguard(name, guard);
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shmclose
+// Description  : Unmap the shared memory tier, removing it if no other process holds it
+//
+// Inputs       : name - the POSIX shared memory object name
+// Outputs      : none
+
+static void lcloud_shmclose( const char *name ) {
+    int guard;
+
+    if (shmmap == NULL){
+        return;
+    }
+
+    //Trading the shared flock for an exclusive one only works if this is the last process (a
+    // forked child shares its parent's flock, so it just lets go of its copy of the mapping)
+    guard = (shmpid == getpid()) ? lcloud_shmguard(name, -1) : -1;
+    if (guard != -1 && flock(shmfd, LOCK_EX | LOCK_NB) == 0){
+        shm_unlink(name);
+    }
+    munmap(shmmap, shmmapbytes);
+    close(shmfd);
+    if (guard != -1){
+        lcloud_shmguard(name, guard);
+    }
+    shmmap = NULL;
+    shmsets = NULL;
+    shmmask = 0;
+    shmfd = -1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -142,17 +4059,87 @@ int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
 // Function     : lcloud_initcache
 // Description  : Initialze the cache by setting up metadata a cache elements.
 //
-// Inputs       : maxblocks - the max number number of blocks 
+// Inputs       : maxblocks - the max number number of blocks
 // Outputs      : 0 if successful, -1 if failure
 
 int lcloud_initcache( int maxblocks ) {
-    //For each line of the cache, initialize the values to null
-    for (int i=0; i<maxblocks; i++){
-        currentsize = 0;
-        lrucache[i].devid = NULL;
-        lrucache[i].sector = NULL;
-        lrucache[i].block = NULL;
-        lrucache[i].time = NULL;
+    //The cache needs room for at least one block and a known policy
+    if (maxblocks < 1){
+        logMessage(LOG_ERROR_LEVEL, "Bad cache size [%d]", maxblocks);
+        return( -1 );
+    }
+    if (lcloud_cachepolicy < 0 || lcloud_cachepolicy >= LC_CACHE_MAXPOLICY){
+        logMessage(LOG_ERROR_LEVEL, "Bad cache policy [%d]", lcloud_cachepolicy);
+        return( -1 );
+    }
+    if (lcloud_cacheshards < 1 || lcloud_cacheshards > LC_CACHE_MAXSHARDS){
+        logMessage(LOG_ERROR_LEVEL, "Bad cache shard count [%d]", lcloud_cacheshards);
+        return( -1 );
+    }
+
+    //Drop any storage left from a previous initialization
+    lcloud_closecache();
+
+    //Use the largest power of two shards not over the requested count, with at least one line each
+    shardbits = 0;
+    while ((2 << shardbits) <= lcloud_cacheshards && (2 << shardbits) <= maxblocks){
+        shardbits++;
+    }
+    shardcount = 1 << shardbits;
+    cacheblocks = maxblocks;
+    bypassblocks = (lcloud_cacheadmission ? shardcount * LC_BYPASS_LINES : 0);
+    mrcwidth = (maxblocks >= 4) ? maxblocks / 4 : 1;
+
+    //Size the arena for the slab and every shard's lines and line index
+    arenabytes = ((size_t)(maxblocks + bypassblocks) << 8) + 64;
+    for (int j=0; j<shardcount; j++){
+        int lines = maxblocks / shardcount + (j < maxblocks % shardcount);
+        arenabytes += sizeof(cache) * lines + sizeof(lineset) * ((size_t)1 << lcloud_setbits(lines)) + 128;
+    }
+    if (lcloud_arenaopen(arenabytes) != 0){
+        return( -1 );
+    }
+
+    //Allocate the shards and split the lines over them as evenly as possible
+    policy = &cachepolicies[lcloud_cachepolicy];
+    if ((shards = (cacheshard *)calloc(shardcount, sizeof(cacheshard))) == NULL ||
+        (cacheslab = (char *)lcloud_arenaalloc((size_t)(maxblocks + bypassblocks) << 8)) == NULL){
+        logMessage(LOG_ERROR_LEVEL, "Unable to allocate a cache of %d blocks", maxblocks);
+        free(shards);
+        shards = NULL;
+        lcloud_arenaclose();
+        return( -1 );
+    }
+    if (lcloud_cachel2file != NULL && lcloud_l2open(lcloud_cachel2file, lcloud_cachel2blocks) != 0){
+        lcloud_closecache();
+        return( -1 );
+    }
+    if (lcloud_cacheshmname != NULL && lcloud_shmopen(lcloud_cacheshmname, lcloud_cacheshmblocks) != 0){
+        lcloud_closecache();
+        return( -1 );
+    }
+    for (int j=0, base=0, l2base=0; j<shardcount; j++){
+        pthread_mutex_init(&shards[j].lock, NULL);
+        pthread_cond_init(&shards[j].loaded, NULL);
+        if (l2map != NULL){
+            shards[j].l2size = lcloud_cachel2blocks / shardcount + (j < lcloud_cachel2blocks % shardcount);
+            shards[j].l2data = l2map + ((size_t)l2base << 8);
+            l2base += shards[j].l2size;
+        }
+        if (lcloud_initshard(&shards[j], base, maxblocks / shardcount + (j < maxblocks % shardcount)) != 0){
+            logMessage(LOG_ERROR_LEVEL, "Unable to allocate a cache of %d blocks", maxblocks);
+            lcloud_closecache();
+            return( -1 );
+        }
+        base += shards[j].maxsize;
+        if (bypassblocks > 0){
+            shards[j].bypass = cacheslab + ((size_t)(maxblocks + j * LC_BYPASS_LINES) << 8);
+        }
+    }
+
+    //Start warm from the last run's blocks if there is a snapshot
+    if (lcloud_cachesnapshot != NULL){
+        lcloud_loadsnapshot(lcloud_cachesnapshot);
     }
 
     return( 0 );
@@ -167,22 +4154,157 @@ int lcloud_initcache( int maxblocks ) {
 // Outputs      : 0 if successful, -1 if failure
 
 int lcloud_closecache( void ) {
-    //Variable for total accesses
-    int totaccess;
-    float hitratio;
-    //Add up total accesses
-    totaccess = hits + misses;
-    float newhits = (float)hits;
-    float newaccess = (float)totaccess;
-    //Calculate the hit ratio percentage
-    hitratio = (newhits/newaccess);
-    //Print out all of the statistics
+    //Variables for the totals over every shard (the counters only kept per shard)
+    LcCacheStats *stats;
+    uint64_t totaccess;
+    int zstored = 0, zevicted = 0, zinbytes = 0;
+    int l2stored = 0, l2evicted = 0;
+    int shmstored = 0, flushed;
+    int multiples[] = { 1, 2, 4, 16, LC_MRC_MAXMULTIPLE };
+    double estimate;
+
+    if (shards == NULL){
+        return( 0 );
+    }
+
+    //Report the statistics, writing back anything still dirty first (and naming every block
+    // whose write back failed, it is lost when the lines are freed)
+    if ((flushed = lcloud_flushcache()) != 0){
+        for (int j=0; j<shardcount; j++){
+            for (int i=0; i<shards[j].currentsize; i++){
+                if (shards[j].lrucache[i].dirty){
+                    logMessage(LOG_ERROR_LEVEL, "Dirty cache block [%d/%d/%d] lost on cache close",
+                     shards[j].lrucache[i].devid, shards[j].lrucache[i].sector, shards[j].lrucache[i].block);
+                }
+            }
+        }
+    }
+    if ((stats = (LcCacheStats *)malloc(sizeof(LcCacheStats))) == NULL){
+        logMessage(LOG_ERROR_LEVEL, "Unable to allocate the cache statistics");
+        return( -1 );
+    }
+    lcloud_cachestats(stats);
+    for (int j=0; j<shardcount; j++){
+        zstored += shards[j].zstored;
+        zevicted += shards[j].zevicted;
+        zinbytes += shards[j].zinbytes;
+        l2stored += shards[j].l2stored;
+        l2evicted += shards[j].l2evicted;
+        shmstored += shards[j].shmstored;
+    }
+    totaccess = stats->total.hits + stats->total.misses;
     logMessage(LcDriverLLevel,
-     "\nTOTAL ACCESSES: %d\nTOTAL HITS: %d\nTOTAL MISSES: %d\nHIT RATIO PERCENTAGE: %.2f",
-     totaccess, hits, misses, (100.00*hitratio));
+     "\nCACHE POLICY: %s (%s)\nCACHE SIZE (BLOCKS): %d\nCACHE SHARDS: %d\nCACHE MEMORY: %s\nTOTAL ACCESSES: %llu\nTOTAL HITS: %llu\nTOTAL MISSES: %llu\n%s HIT RATIO PERCENTAGE: %.2f\nINSERTIONS: %llu\nEVICTIONS: %llu\nDEVICE WRITES: %llu\nDIRTY FLUSHES: %llu\nBYTES SAVED: %llu\nPREFETCHED BLOCKS: %llu\nPREFETCH HITS: %llu\nPREFETCH WASTED: %llu\nCOALESCED MISSES: %llu",
+     policy->name, lcloud_cachewriteback ? "WRITE-BACK" : "WRITE-THROUGH", stats->blocks, shardcount,
+     (stats->arena == LC_CACHE_HUGETLB) ? "HUGE PAGES" : (stats->arena == LC_CACHE_THP) ? "TRANSPARENT HUGE PAGES" : "HEAP",
+     (unsigned long long)totaccess, (unsigned long long)stats->total.hits, (unsigned long long)stats->total.misses,
+     policy->name, (totaccess > 0) ? (100.00 * stats->total.hits / totaccess) : 0.0,
+     (unsigned long long)stats->total.insertions, (unsigned long long)stats->total.evictions,
+     (unsigned long long)stats->total.writes, (unsigned long long)stats->total.flushes,
+     (unsigned long long)stats->total.bytessaved, (unsigned long long)stats->prefetches,
+     (unsigned long long)stats->prefetchhits, (unsigned long long)stats->prefetchwasted,
+     (unsigned long long)stats->coalesced);
+    logMessage(LcDriverLLevel, "LOOKUP LATENCY (NS): P50 %.0f, P90 %.0f, P99 %.0f",
+     lcloud_cachelatency(stats, 0.50), lcloud_cachelatency(stats, 0.90), lcloud_cachelatency(stats, 0.99));
 
-    /* Return successfully */
-    return( 0 );
-}
+    //Break the lookups down by device
+    for (int d=0; d<LC_CACHE_STATDEVICES; d++){
+        LcCacheCounters *c = &stats->device[d];
+        if (c->hits + c->misses > 0){
+            logMessage(LcDriverLLevel, "DEVICE %d: %llu HITS, %llu MISSES, HIT RATIO %.2f, %llu EVICTIONS, %llu WRITES",
+             d, (unsigned long long)c->hits, (unsigned long long)c->misses, 100.0 * c->hits / (c->hits + c->misses),
+             (unsigned long long)c->evictions, (unsigned long long)c->writes);
+        }
+    }
+
+    if (lcloud_cachezbytes > 0){
+        logMessage(LcDriverLLevel,
+         "COMPRESSED TIER (BYTES): %d\nCOMPRESSED BLOCKS STORED: %d\nCOMPRESSED HITS: %d\nCOMPRESSED EVICTIONS: %d\nCOMPRESSION RATIO: %.2f",
+         lcloud_cachezbytes, zstored, (int)stats->zhits, zevicted, (zinbytes > 0) ? (256.0 * zstored / zinbytes) : 0.0);
+    }
+
+    if (l2map != NULL){
+        logMessage(LcDriverLLevel,
+         "DISK TIER (BLOCKS): %d\nDISK TIER BLOCKS STORED: %d\nDISK TIER HITS: %d\nDISK TIER EVICTIONS: %d",
+         lcloud_cachel2blocks, l2stored, (int)stats->l2hits, l2evicted);
+    }
+
+    if (shmmap != NULL){
+        logMessage(LcDriverLLevel,
+         "SHARED MEMORY TIER [%s] (BLOCKS): %u\nSHARED MEMORY BLOCKS PUBLISHED: %d\nSHARED MEMORY HITS: %d",
+         lcloud_cacheshmname, shmmap->sets * LC_SHM_WAYS, shmstored, (int)stats->shmhits);
+    }
+
+    if (lcloud_cacheadmission){
+        logMessage(LcDriverLLevel, "TINYLFU ADMITTED: %llu\nTINYLFU REJECTED: %llu",
+         (unsigned long long)stats->admitted, (unsigned long long)stats->rejected);
+    }
+
+    //Report how each partition in use did
+    for (int p=0; partitioned && p<LC_CACHE_MAXPARTS; p++){
+        int psize = 0, phits = 0, pmisses = 0;
+        for (int j=0; j<shardcount; j++){
+            psize += shards[j].partsize[p];
+            phits += shards[j].parthits[p];
+            pmisses += shards[j].partmisses[p];
+        }
+        if (phits + pmisses > 0 || partmax[p] > 0 || partmin[p] > 0){
+            logMessage(LcDriverLLevel, "PARTITION %d (MIN %d, MAX %d): %d BLOCKS, %d HITS, %d MISSES, HIT RATIO %.2f",
+             p, partmin[p], partmax[p], psize, phits, pmisses, (phits + pmisses > 0) ? (100.0 * phits / (phits + pmisses)) : 0.0);
+        }
+    }
+
+    //Report what the sampled reuse distances say an LRU cache of other sizes would have hit
+    for (int j=0; j<(int)(sizeof(multiples)/sizeof(multiples[0])); j++){
+        estimate = lcloud_cachemrc(multiples[j] * stats->blocks);
+        if (estimate >= 0){
+            logMessage(LcDriverLLevel, "ESTIMATED LRU HIT RATIO AT %dX (%d BLOCKS): %.2f",
+             multiples[j], multiples[j] * stats->blocks, 100.00 * estimate);
+        }
+    }
+    free(stats);
+
+    //Keep the cached blocks for the next run
+    if (lcloud_cachesnapshot != NULL){
+        lcloud_savesnapshot(lcloud_cachesnapshot);
+    }
 
+    //Release the cache storage
+    for (int j=0; j<shardcount; j++){
+        lcloud_arenafree(shards[j].lrucache);
+        lcloud_arenafree(shards[j].sets);
+        free(shards[j].ghosts);
+        free(shards[j].ghostbuckets);
+        free(shards[j].lfuheap);
+        free(shards[j].mrcsamples);
+        free(shards[j].mrcbuckets);
+        free(shards[j].mrctree);
+        for (int z=0; shards[j].zentries != NULL && z<shards[j].zsize; z++){
+            free(shards[j].zentries[z].data);
+        }
+        free(shards[j].zentries);
+        free(shards[j].zbuckets);
+        free(shards[j].sketch);
+        free(shards[j].filestats);
+        free(shards[j].l2entries);
+        free(shards[j].l2buckets);
+        pthread_mutex_destroy(&shards[j].lock);
+        pthread_cond_destroy(&shards[j].loaded);
+    }
+    free(shards);
+    lcloud_arenafree(cacheslab);
+    lcloud_arenaclose();
+    if (l2map != NULL){
+        munmap(l2map, l2mapbytes);
+        l2map = NULL;
+    }
+    lcloud_shmclose(lcloud_cacheshmname);
+    shards = NULL;
+    cacheslab = NULL;
+    bypassblocks = 0;
+    shardcount = 0;
+    shardbits = 0;
 
+    /* Return successfully, unless dirty blocks were lost */
+    return( flushed );
+}
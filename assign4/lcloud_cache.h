@@ -16,21 +16,175 @@
 #include <lcloud_controller.h>
 
 // Defines 
-#define LC_CACHE_MAXBLOCKS 64
+#define LC_CACHE_MAXBLOCKS 64 // Default cache size (in blocks)
+#define LC_CACHE_MAXSHARDS 256 // Maximum number of independently locked cache shards
+#define LC_CACHE_MAXPARTS 16 // Number of cache partitions quotas can be set for
+#define LC_CACHE_L2BLOCKS 65536 // Default size of the disk tier (in blocks)
+#define LC_CACHE_SHMBLOCKS 16384 // Default size of the shared memory tier (in blocks)
+#define LC_CACHE_STATDEVICES 16 // Devices the statistics are broken down by (ids below this)
+#define LC_CACHE_STATFILES 1024 // Files the statistics are broken down by (file table slots below this)
+#define LC_CACHE_LATBUCKETS 32 // Lookup latency histogram slots, slot i counts 2^i to 2^(i+1) ns
+#define LC_CACHE_MAXDEVICES 64 // Devices lcloud_setcachedevices can describe
+
+// Type definitions
+
+/* Cache replacement policies */
+typedef enum {
+    LC_CACHE_LRU       = 0, // Least recently used
+    LC_CACHE_CLOCK     = 1, // CLOCK (second chance)
+    LC_CACHE_2Q        = 2, // 2Q (A1in FIFO, A1out ghosts, Am LRU)
+    LC_CACHE_ARC       = 3, // Adaptive replacement cache
+    LC_CACHE_LFU       = 4, // Least frequently used
+    LC_CACHE_MAXPOLICY = 5  // Maximum policy number
+} LcCachePolicy;
+
+/* Memory the cache slab and line metadata are allocated from */
+typedef enum {
+    LC_CACHE_HEAP    = 0, // Plain heap (caches under one huge page, or huge pages turned off)
+    LC_CACHE_THP     = 1, // 2 MB aligned arena marked for transparent huge pages
+    LC_CACHE_HUGETLB = 2  // Arena of reserved 2 MB huge pages
+} LcCacheArena;
+
+/* Cache event counters, kept for the whole cache and for each device and file */
+typedef struct {
+    uint64_t hits;       // Lookups that found the block
+    uint64_t misses;     // Lookups that did not
+    uint64_t insertions; // Blocks put in a line
+    uint64_t evictions;  // Lines evicted to make room
+    uint64_t flushes;    // Dirty lines written back
+    uint64_t writes;     // Device writes made through the cache (flushes included)
+    uint64_t bytessaved; // Bus bytes not moved, by hits and by writes merged into dirty lines
+} LcCacheCounters;
+
+/* Cache statistics filled in by lcloud_cachestats */
+typedef struct {
+    int blocks;                                  // Cache size (in blocks)
+    int used;                                    // Lines holding a block
+    LcCacheArena arena;                          // Memory the slab and line metadata are in
+    LcCacheCounters total;                       // Counters for the whole cache
+    LcCacheCounters device[LC_CACHE_STATDEVICES]; // Counters by device the block is on
+    LcCacheCounters file[LC_CACHE_STATFILES];    // Counters by file table slot that made the access
+    uint64_t prefetches;                         // Blocks put in by readahead
+    uint64_t prefetchhits;                       // Of those, used
+    uint64_t prefetchwasted;                     // Of those, evicted unused
+    uint64_t coalesced;                          // Misses that waited on another thread's load of the block
+    uint64_t zhits;                              // Hits brought up from the compressed tier
+    uint64_t l2hits;                             // Hits brought up from the disk tier
+    uint64_t shmhits;                            // Hits brought up from the shared memory tier
+    uint64_t admitted;                           // New blocks the admission filter let evict a line
+    uint64_t rejected;                           // New blocks it turned away
+    uint64_t latency[LC_CACHE_LATBUCKETS];       // Lookup latency histogram of sampled lookups (log2 ns)
+} LcCacheStats;
+
+/* A device the cached blocks come from, as lcloud_setcachedevices describes it */
+typedef struct {
+    int32_t id;      // Device id
+    int32_t sectors; // Sectors on the device
+    int32_t blocks;  // Blocks in each sector
+} LcCacheDevice;
+
+/* Reads a block into the cache line buffer on a miss, returns 0 on success */
+typedef int (*LcCacheLoader)( LcDeviceId did, uint16_t sec, uint16_t blk, char *block, void *arg );
+
+/* Writes a block to the device for write-through and dirty line flushes, returns 0 on success */
+typedef int (*LcCacheWriter)( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
 
 //
-// Functional Prototypes
+// Global data
 
-char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk );
-    // Search the cache for a block 
+extern int lcloud_cacheblocks; // Cache size (in blocks) used when the filesystem powers on
+extern int lcloud_cacheshards; // Number of locked shards (rounded down to a power of two)
+extern LcCachePolicy lcloud_cachepolicy; // Replacement policy used by lcloud_initcache
+extern int lcloud_cachewriteback; // Hold writes as dirty lines until eviction/flush when set
+extern int lcloud_cachezbytes; // Memory (in bytes) for the compressed tier, 0 for none
+extern char *lcloud_cachesnapshot; // File to save the cache to at close and warm it from at init
+extern int lcloud_cacheadmission; // Turn away new blocks used less lately than the victim (TinyLFU) when set
+extern char *lcloud_cachel2file; // Local file for the disk tier evicted blocks go to, NULL for none
+extern int lcloud_cachel2blocks; // Size of the disk tier (in blocks)
+
+// The shared memory tier is a store of blocks below each process's own lines, shared by every
+// process on the host that opens it by the same name. It is NOT a coherent shared cache: a
+// block one process writes is published to the tier, but a copy another process already holds
+// in its own lines (or its compressed or disk tier) is not invalidated, and that process keeps
+// reading the old data until it evicts or drops the block. Processes that write blocks others
+// read must drop them there (lcloud_dropcache), or not share a tier.
+extern char *lcloud_cacheshmname; // POSIX shared memory name of a tier shared by co-located processes, NULL for none
+extern int lcloud_cacheshmblocks; // Size of the shared memory tier (in blocks) if this process creates it
+extern int lcloud_cachehugepages; // Allocate the slab and line metadata from a huge page arena when set
+
+//
+// Functional Prototypes
 
 int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
     // Put a value in the cache 
 
+char * lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Search the cache for a block and pin it in place (so no other thread evicts it until it is unpinned)
+
+int lcloud_unpincache( char *block );
+    // Release a pinned block
+
+char * lcloud_getorloadcache( LcDeviceId did, uint16_t sec, uint16_t blk, LcCacheLoader loader, void *arg );
+    // Get a block, loading it into the cache on a miss, returned pinned
+
+int lcloud_writecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Write a block through the cache (held dirty in write-back mode)
+
+int lcloud_flushcache( void );
+    // Write every dirty block back to the device
+
+int lcloud_dropcache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Drop a block from the cache without writing it back
+
+int lcloud_evictcache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Write a block back if dirty and drop it from the cache (1 if kept because it is pinned)
+
+int lcloud_incache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Check whether a block is cached (no access is counted)
+
+int lcloud_peekcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Copy a block out of the cache if it is there, for reads around it (nothing is promoted or counted)
+
+int lcloud_prefetchcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Put a block read ahead of need in the cache, unless already cached
+
+void lcloud_prefetchstats( int *used, int *wasted );
+    // Get how many prefetched blocks were used and how many were evicted unused
+
+double lcloud_cachemrc( int blocks );
+    // Estimate the LRU hit ratio for another cache size (up to 64x), -1 if unknown
+
+void lcloud_setcachewriter( LcCacheWriter writer );
+    // Set the function used to write blocks to the device
+
+int lcloud_setcachedevices( const LcCacheDevice *devices, int count );
+    // Describe the devices (ids and geometry) before lcloud_initcache, a snapshot of another set is not loaded
+
+int lcloud_setcachequota( int part, int minblocks, int maxblocks );
+    // Set the min and max blocks (0 for no max) a cache partition holds
+
+int lcloud_setdevicepartition( LcDeviceId did, int part );
+    // Put a device's blocks in a cache partition
+
+void lcloud_usecachepartition( int part );
+    // Put the calling thread's blocks in a cache partition, -1 to go by device
+
+void lcloud_usecachefile( int file );
+    // Count the calling thread's accesses for a file in the statistics, -1 for none
+
+int lcloud_cachestats( LcCacheStats *stats );
+    // Get the cache statistics so far
+
+double lcloud_cachelatency( const LcCacheStats *stats, double fraction );
+    // Get a lookup latency percentile (in ns) from the statistics' histogram
+
 int lcloud_initcache( int maxblocks );
     // Initialze the cache by setting up metadata a cache elements.
 
 int lcloud_closecache( void );
-    // Clean up the cache when program is closing.
+    // Clean up the cache when program is closing, -1 if dirty blocks could not be written back
+
+int lcloud_cachepolicybyname( const char *name );
+    // Look up a replacement policy by name, -1 if unknown
 
 #endif
@@ -0,0 +1,628 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_cachebench.c
+//  Description    : This is a microbenchmark for the LionCloud block cache,
+//                   it drives lcloud_getorloadcache from several threads at
+//                   once and reports the throughput and average lookup time
+//                   for each thread count (optionally with the cache on the
+//                   heap as well as the huge page arena, to compare). It also
+//                   has checks of the cache that exit non-zero if they fail.
+//
+//   Author        : Michael McDonough
+//   Last Modified : FRI APRIL 17 2020
+//
+
+// Include Files
+#include <cmpsc311_log.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Project Includes
+#include <lcloud_cache.h>
+#include <lcloud_support.h>
+
+// Defines
+#define LCLOUD_BENCH_ARGUMENTS "hgfac:p:s:t:n:m:"
+#define USAGE                                                       \
+    "USAGE: lcloud_cachebench [-h] [-g] [-c <blocks>] [-p <policy>] [-s <shards>] [-t <threads>] [-n <ops>]\n" \
+    "                         [-f] [-a] [-m <shm name>]\n"          \
+    "\n"                                                            \
+    "where:\n"                                                      \
+    "    -h - help mode (display this message)\n"                   \
+    "    -g - run each thread count with the cache on the heap too, to compare with huge pages\n" \
+    "    -c - size of the block cache in blocks (default 4096)\n"   \
+    "    -p - cache replacement policy: lru, clock, 2q, arc or lfu\n" \
+    "    -s - number of cache shards (default: the thread count)\n" \
+    "    -t - largest number of threads, runs 1, 2, 4 ... up to it (default 16)\n" \
+    "    -n - lookups per thread (default 1000000)\n"               \
+    "    -f - instead of the benchmark, check that threads missing on the same blocks load each once\n" \
+    "    -a - instead of the benchmark, check which memory the cache lands in with and without huge pages\n" \
+    "    -m - instead of the benchmark, check the shared memory tier of that name across processes\n" \
+    "\n"
+
+//Blocks the shared memory check publishes, the one a process writes and the byte it writes
+#define LC_BENCH_SHMKEYS 256
+#define LC_BENCH_SHMWRITE 7
+#define LC_BENCH_SHMBYTE 0x5A
+
+//Blocks every thread of the single flight check misses on, and how long a load of one takes (us)
+#define LC_BENCH_FLIGHTKEYS 256
+#define LC_BENCH_FLIGHTLOAD 1000
+
+//Cache sizes (in blocks) of the arena check, one well under a huge page and one of several
+#define LC_BENCH_SMALLCACHE 64
+#define LC_BENCH_LARGECACHE 16384
+
+//Arguments and results for one benchmark thread
+typedef struct {
+    pthread_t thread;
+    uint64_t seed;
+    int ops;
+    int keys;
+    int errors;
+    int *loads;                  // Load counters of the single flight check
+    pthread_barrier_t *start;    // Lines the single flight check's threads up on the first miss
+}benchthread;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchloader
+// Description  : cache loader that makes up the block instead of reading a device,
+//                every byte is the low byte of the block number
+//
+// Inputs       : did - the device of the block
+//                sec - the sector of the block
+//                blk - the block number
+//                block - the cache line buffer to fill
+//                arg - unused
+// Outputs      : 0 always
+
+int benchloader( LcDeviceId did, uint16_t sec, uint16_t blk, char *block, void *arg ) {
+    memset(block, (char)blk, 256);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : countloader
+// Description  : cache loader like benchloader that also counts the loads of each block
+//
+// Inputs       : did - the device of the block
+//                sec - the sector of the block
+//                blk - the block number
+//                block - the cache line buffer to fill
+//                arg - array of load counters indexed by the bench key (sec << 4 | did)
+// Outputs      : 0 always
+
+int countloader( LcDeviceId did, uint16_t sec, uint16_t blk, char *block, void *arg ) {
+    int *loads = (int *)arg;
+
+    __atomic_add_fetch(&loads[(sec << 4) | (did & 0xF)], 1, __ATOMIC_RELAXED);
+    memset(block, (char)blk, 256);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slowloader
+// Description  : countloader for a slow device, so other threads miss on the block while
+//                it is being loaded
+//
+// Inputs       : did, sec, blk, block, arg - as countloader
+// Outputs      : 0 always
+
+int slowloader( LcDeviceId did, uint16_t sec, uint16_t blk, char *block, void *arg ) {
+    usleep(LC_BENCH_FLIGHTLOAD);
+    return (countloader(did, sec, blk, block, arg));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchwriter
+// Description  : cache writer for the checks, the made up device takes any block
+//
+// Inputs       : did, sec, blk - the block
+//                block - the 256 byte block
+// Outputs      : 0 always
+
+int benchwriter( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchlookup
+// Description  : Look up a bench key (loading it with countloader on a miss)
+//
+// Inputs       : key - the bench key, spread over 16 devices like benchworker does
+//                loader - countloader or slowloader
+//                loads - the load counters
+// Outputs      : the first byte of the block, -1 if the lookup failed
+
+int benchlookup( int key, LcCacheLoader loader, int *loads ) {
+    char *line;
+    int byte;
+
+    if ((line = lcloud_getorloadcache(key & 0xF, key >> 4, key >> 4, loader, loads)) == NULL) {
+        return (-1);
+    }
+    byte = (unsigned char)line[0];
+    lcloud_unpincache(line);
+    return (byte);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchshmreader
+// Description  : Child process of the shared memory check, opens the tier with a cold cache
+//                of its own and reads the blocks the parent published (none should need a
+//                load), then, if asked, writes one of them
+//
+// Inputs       : write - 1 to write LC_BENCH_SHMWRITE after reading
+// Outputs      : exits with the number of errors found
+
+void benchshmreader( int write ) {
+    int loads[LC_BENCH_SHMKEYS], errors = 0, byte;
+    char block[256];
+
+    memset(loads, 0, sizeof(loads));
+    if (lcloud_initcache(64) != 0) {
+        _exit(1);
+    }
+    for (int k=0; k<LC_BENCH_SHMKEYS; k++) {
+        byte = benchlookup(k, countloader, loads);
+        if (loads[k] != 0 || byte != ((k == LC_BENCH_SHMWRITE && !write) ? LC_BENCH_SHMBYTE : ((k >> 4) & 0xFF))) {
+            fprintf(stderr, "Process %d: block %d loaded %d times, byte %d\n", (int)getpid(), k, loads[k], byte);
+            errors++;
+        }
+    }
+    if (write) {
+        memset(block, LC_BENCH_SHMBYTE, 256);
+        if (lcloud_writecache(LC_BENCH_SHMWRITE & 0xF, LC_BENCH_SHMWRITE >> 4, LC_BENCH_SHMWRITE >> 4, block) != 0) {
+            errors++;
+        }
+    }
+    lcloud_closecache();
+    _exit(errors > 255 ? 255 : errors);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchshm
+// Description  : Check the shared memory tier across processes: a segment left by a process
+//                that died is not reused, blocks one process loads are read by others without
+//                loading them, a block one writes reaches the next to open the tier, and the
+//                segment goes away with the last process to close it (and only then)
+//
+// Inputs       : name - the POSIX shared memory object name to use
+// Outputs      : 0 if every check passed, -1 if not
+
+int benchshm( const char *name ) {
+    int loads[LC_BENCH_SHMKEYS], errors = 0, status, fd;
+    pid_t pid;
+
+    lcloud_cacheshmname = (char *)name;
+    lcloud_setcachewriter(benchwriter);
+    memset(loads, 0, sizeof(loads));
+
+    //A process that ends without closing the cache leaves the segment (and its blocks) behind
+    if ((pid = fork()) == 0) {
+        _exit((lcloud_initcache(64) != 0 || benchlookup(LC_BENCH_SHMWRITE, countloader, loads) == -1) ? 1 : 0);
+    }
+    if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Process that leaves the tier behind failed\n");
+        return (-1);
+    }
+
+    //The next process to open it has to throw it away and start empty
+    if (lcloud_initcache(64) != 0) {
+        return (-1);
+    }
+    if (lcloud_incache(LC_BENCH_SHMWRITE & 0xF, LC_BENCH_SHMWRITE >> 4, LC_BENCH_SHMWRITE >> 4)) {
+        fprintf(stderr, "Stale shared memory tier was reused\n");
+        errors++;
+    }
+    printf("SHM STALE SEGMENT REMOVED: %s\n", errors ? "FAIL" : "PASS");
+
+    //Publish every block from this process (its own cache holds only a few of them)
+    for (int k=0; k<LC_BENCH_SHMKEYS; k++) {
+        if (benchlookup(k, countloader, loads) != ((k >> 4) & 0xFF) || loads[k] != 1) {
+            errors++;
+        }
+    }
+
+    //Another process reads them all from the tier and writes one, then a third reads the new data
+    for (int write=1; write>=0; write--) {
+        if ((pid = fork()) == 0) {
+            benchshmreader(write);
+        }
+        if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            errors++;
+        }
+    }
+    printf("SHM BLOCKS SHARED ACROSS PROCESSES: %d, WRITE SEEN BY NEXT PROCESS: %s\n", LC_BENCH_SHMKEYS,
+     errors ? "FAIL" : "PASS");
+
+    //The children closed cleanly while this process still had the tier, it has to still be there
+    // until this process closes it too
+    if ((fd = shm_open(name, O_RDWR, 0600)) == -1) {
+        fprintf(stderr, "Shared memory tier removed while still in use\n");
+        errors++;
+    }
+    else {
+        close(fd);
+    }
+    lcloud_closecache();
+    if ((fd = shm_open(name, O_RDWR, 0600)) != -1 || errno != ENOENT) {
+        fprintf(stderr, "Shared memory tier left behind by the last close\n");
+        if (fd != -1) {
+            close(fd);
+        }
+        shm_unlink(name);
+        errors++;
+    }
+    printf("SHM SEGMENT LIFETIME: %s\n", errors ? "FAIL" : "PASS");
+    lcloud_cacheshmname = NULL;
+    return (errors ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flightworker
+// Description  : Thread of the single flight check, starts with the others and then looks up
+//                the same blocks in the same order as them
+//
+// Inputs       : arg - the thread's benchthread
+// Outputs      : NULL
+
+void *flightworker( void *arg ) {
+    benchthread *t = (benchthread *)arg;
+
+    pthread_barrier_wait(t->start);
+    for (int k=0; k<t->keys; k++) {
+        if (benchlookup(k, slowloader, t->loads) != ((k >> 4) & 0xFF)) {
+            t->errors++;
+        }
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchflight
+// Description  : Check that concurrent misses on a block share one load of it: every thread
+//                misses on the same blocks at once, each block must be loaded exactly once
+//                and the other threads counted as coalesced onto that load
+//
+// Inputs       : nthreads - the number of threads
+//                blocks - the size of the cache (raised to hold every block of the check)
+// Outputs      : 0 if the check passed, -1 if not
+
+int benchflight( int nthreads, int blocks ) {
+    int loads[LC_BENCH_FLIGHTKEYS], errors = 0, once = 0;
+    pthread_barrier_t start;
+    benchthread *threads;
+    LcCacheStats *stats;
+
+    threads = (benchthread *)malloc(sizeof(benchthread) * nthreads);
+    stats = (LcCacheStats *)malloc(sizeof(LcCacheStats));
+    if (threads == NULL || stats == NULL || lcloud_initcache(blocks < LC_BENCH_FLIGHTKEYS ? LC_BENCH_FLIGHTKEYS : blocks) != 0) {
+        free(threads);
+        free(stats);
+        return (-1);
+    }
+    memset(loads, 0, sizeof(loads));
+    pthread_barrier_init(&start, NULL, nthreads);
+    for (int i=0; i<nthreads; i++) {
+        threads[i].keys = LC_BENCH_FLIGHTKEYS;
+        threads[i].errors = 0;
+        threads[i].loads = loads;
+        threads[i].start = &start;
+        pthread_create(&threads[i].thread, NULL, flightworker, &threads[i]);
+    }
+    for (int i=0; i<nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        errors += threads[i].errors;
+    }
+    pthread_barrier_destroy(&start);
+    lcloud_cachestats(stats);
+    lcloud_closecache();
+
+    //Every block loaded exactly once, no matter how many threads missed on it
+    for (int k=0; k<LC_BENCH_FLIGHTKEYS; k++) {
+        if (loads[k] == 1) {
+            once++;
+        }
+        else {
+            fprintf(stderr, "Block %d loaded %d times\n", k, loads[k]);
+        }
+    }
+    printf("SINGLE FLIGHT: %d threads, %d of %d blocks loaded once, %lu misses coalesced, %d bad lookups: %s\n",
+     nthreads, once, LC_BENCH_FLIGHTKEYS, (unsigned long)stats->coalesced, errors,
+     (once == LC_BENCH_FLIGHTKEYS && errors == 0) ? "PASS" : "FAIL");
+    free(stats);
+    free(threads);
+    return ((once == LC_BENCH_FLIGHTKEYS && errors == 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freehugepages
+// Description  : Find how many reserved huge pages the system has free (HugePages_Free)
+//
+// Inputs       : none
+// Outputs      : the number of free huge pages, 0 if there are none or it cannot tell
+
+int freehugepages( void ) {
+    char line[128];
+    int pages = 0;
+    FILE *meminfo;
+
+    if ((meminfo = fopen("/proc/meminfo", "r")) == NULL) {
+        return (0);
+    }
+    while (fgets(line, sizeof(line), meminfo) != NULL) {
+        if (sscanf(line, "HugePages_Free: %d", &pages) == 1) {
+            break;
+        }
+    }
+    fclose(meminfo);
+    return (pages);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchonearena
+// Description  : Open a cache and check the memory it reports it is in, and that blocks
+//                looked up in it come back right
+//
+// Inputs       : blocks - the size of the cache
+//                huge - the value for lcloud_cachehugepages
+//                expect - the arena it should be in
+//                orthp - 1 if transparent huge pages are fine as well (the reserved ones
+//                        might not be enough for it)
+// Outputs      : 0 if the check passed, -1 if not
+
+int benchonearena( int blocks, int huge, LcCacheArena expect, int orthp ) {
+    const char *arenanames[] = { "heap", "thp", "hugetlb" };
+    int loads[LC_BENCH_FLIGHTKEYS], errors = 0;
+    LcCacheStats *stats;
+
+    if ((stats = (LcCacheStats *)malloc(sizeof(LcCacheStats))) == NULL) {
+        return (-1);
+    }
+    lcloud_cachehugepages = huge;
+    if (lcloud_initcache(blocks) != 0) {
+        free(stats);
+        return (-1);
+    }
+    memset(loads, 0, sizeof(loads));
+    for (int k=0; k<LC_BENCH_FLIGHTKEYS; k++) {
+        if (benchlookup(k, countloader, loads) != ((k >> 4) & 0xFF)) {
+            errors++;
+        }
+    }
+    lcloud_cachestats(stats);
+    lcloud_closecache();
+
+    if (stats->arena != expect && !(orthp && stats->arena == LC_CACHE_THP)) {
+        errors++;
+    }
+    printf("ARENA: %6d blocks, huge pages %-3s -> %-7s (expected %s%s), %d bad lookups: %s\n", blocks,
+     huge ? "on" : "off", arenanames[stats->arena], arenanames[expect], orthp ? " or thp" : "", errors,
+     errors ? "FAIL" : "PASS");
+    free(stats);
+    return (errors ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bencharena
+// Description  : Check the cache's memory falls back the way it should: the heap with huge
+//                pages turned off or a cache under one huge page, reserved huge pages when
+//                the system has enough free, and transparent huge pages when it does not
+//
+// Inputs       : none
+// Outputs      : 0 if every check passed, -1 if not
+
+int bencharena( void ) {
+    int errors = 0, pages, needed;
+
+    //The large cache's slab alone is this many huge pages, the metadata needs a few more
+    needed = (LC_BENCH_LARGECACHE * 256) / (2 * 1024 * 1024);
+    pages = freehugepages();
+
+    errors += benchonearena(LC_BENCH_LARGECACHE, 0, LC_CACHE_HEAP, 0);
+    errors += benchonearena(LC_BENCH_SMALLCACHE, 1, LC_CACHE_HEAP, 0);
+    if (pages < needed) {
+        errors += benchonearena(LC_BENCH_LARGECACHE, 1, LC_CACHE_THP, 0);
+    }
+    else {
+        errors += benchonearena(LC_BENCH_LARGECACHE, 1, LC_CACHE_HUGETLB, pages < needed * 2 + 2);
+    }
+    printf("ARENA FALLBACK (%d huge pages free): %s\n", pages, errors ? "FAIL" : "PASS");
+    return (errors ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchworker
+// Description  : Look up random blocks, mostly from a hot set half the size of the cache
+//
+// Inputs       : arg - the thread's benchthread
+// Outputs      : NULL
+
+void *benchworker( void *arg ) {
+    benchthread *t = (benchthread *)arg;
+    uint64_t x = t->seed;
+    int key;
+    char *line;
+
+    for (int i=0; i<t->ops; i++){
+        //xorshift64 random numbers, 90% of the lookups go to the hot set
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        key = (int)((x >> 8) % ((x & 0xFF) < 230 ? t->keys / 4 : t->keys));
+
+        //Spread the keys over 16 devices like the real disks, and check the data that comes back
+        if ((line = lcloud_getorloadcache(key & 0xF, (key >> 4) & 0xFFFF, (key >> 4) & 0xFFFF, benchloader, NULL)) == NULL){
+            t->errors++;
+            continue;
+        }
+        if (line[0] != (char)((key >> 4) & 0xFFFF)){
+            t->errors++;
+        }
+        lcloud_unpincache(line);
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the cache benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful test, -1 if failure
+
+int main( int argc, char *argv[] ) {
+    int ch, blocks = 4096, shards = 0, maxthreads = 16, ops = 1000000, errors = 0, compare = 0, flight = 0, arena = 0;
+    char *shmname = NULL;
+    const char *arenanames[] = { "heap", "thp", "hugetlb" };
+    benchthread *threads;
+    struct timespec start, end;
+    LcCacheStats *stats;
+    double secs, base = 0;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_BENCH_ARGUMENTS)) != -1) {
+        switch (ch) {
+        case 'g': // Compare against the cache on the heap
+            compare = 1;
+            break;
+
+        case 'f': // Check single flight loads instead
+            flight = 1;
+            break;
+
+        case 'a': // Check the cache's memory instead
+            arena = 1;
+            break;
+
+        case 'c': // Set the cache size
+            blocks = atoi(optarg);
+            break;
+
+        case 'p': // Set the cache replacement policy
+            if ((ch = lcloud_cachepolicybyname(optarg)) == -1) {
+                fprintf(stderr, "Unknown cache policy [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            lcloud_cachepolicy = ch;
+            break;
+
+        case 's': // Set the number of shards
+            shards = atoi(optarg);
+            break;
+
+        case 't': // Set the largest thread count
+            maxthreads = atoi(optarg);
+            break;
+
+        case 'n': // Set the lookups per thread
+            ops = atoi(optarg);
+            break;
+
+        case 'm': // Check the shared memory tier instead
+            shmname = optarg;
+            break;
+
+        default: // Help or unknown, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+        }
+    }
+    if (blocks < 1 || maxthreads < 1 || ops < 1 || shards < 0 || shards > LC_CACHE_MAXSHARDS) {
+        fprintf(stderr, USAGE);
+        return (-1);
+    }
+    initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    if (shmname != NULL) {
+        return (benchshm(shmname));
+    }
+    if (arena) {
+        return (bencharena());
+    }
+    if (flight) {
+        lcloud_cacheshards = (shards > 0) ? shards : (maxthreads < LC_CACHE_MAXSHARDS ? maxthreads : LC_CACHE_MAXSHARDS);
+        return (benchflight(maxthreads, blocks));
+    }
+    threads = (benchthread *)malloc(sizeof(benchthread) * maxthreads);
+    stats = (LcCacheStats *)malloc(sizeof(LcCacheStats));
+    if (threads == NULL || stats == NULL) {
+        free(threads);
+        free(stats);
+        return (-1);
+    }
+
+    printf("%8s %8s %8s %14s %10s %10s\n", "THREADS", "SHARDS", "MEMORY", "LOOKUPS/SEC", "NS/LOOKUP", "SPEEDUP");
+    for (int n=1; n<=maxthreads; n = (n < maxthreads && n * 2 > maxthreads) ? maxthreads : n * 2) {
+        for (int heap=compare; heap>=0; heap--) {
+            //Start each run with a fresh cache, sharded for the thread count unless told otherwise
+            lcloud_cacheshards = (shards > 0) ? shards : (n < LC_CACHE_MAXSHARDS ? n : LC_CACHE_MAXSHARDS);
+            lcloud_cachehugepages = !heap;
+            if (lcloud_initcache(blocks) != 0) {
+                free(threads);
+                free(stats);
+                return (-1);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i=0; i<n; i++) {
+                threads[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+                threads[i].ops = ops;
+                threads[i].keys = blocks * 2;
+                threads[i].errors = 0;
+                pthread_create(&threads[i].thread, NULL, benchworker, &threads[i]);
+            }
+            for (int i=0; i<n; i++) {
+                pthread_join(threads[i].thread, NULL);
+                errors += threads[i].errors;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            lcloud_cachestats(stats);
+            lcloud_closecache();
+
+            //Report the aggregate lookup rate, the time a lookup took each thread, and how the rate
+            // compares to the first one thread run
+            secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            if (base == 0) {
+                base = (double)ops / secs;
+            }
+            printf("%8d %8d %8s %14.0f %10.1f %9.2fx\n", n, lcloud_cacheshards, arenanames[stats->arena],
+             (double)ops * n / secs, secs * 1e9 / ops, ((double)ops * n / secs) / base);
+        }
+    }
+
+    free(stats);
+    free(threads);
+    if (errors > 0) {
+        fprintf(stderr, "%d lookups returned bad data\n", errors);
+        return (-1);
+    }
+    return (0);
+}
@@ -13,6 +13,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
@@ -39,8 +41,8 @@ void extract_lcloud_registers(LCloudRegisterFrame resp, uint64_t *b0, uint64_t *
 //Variable to know if an open connection was made
 int socket_handle = -1;
 
-//Declare global variables that hold the value of each register
-uint64_t b0, b1, c0, c1, c2, d0, d1;
+//Global variables that hold the value of each register (defined in lcloud_filesys.c)
+extern uint64_t b0, b1, c0, c1, c2, d0, d1;
 
 int socket_fd;
 
@@ -122,6 +124,9 @@ LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *bu
                 printf( "Error reading buf [%s]\n", strerror(errno) );
                 return( -1);
             } 
+
+            //Convert back to host format, so the caller can check the reply
+            transfer = ntohll64(transfer);
            
            
         }
@@ -159,7 +164,8 @@ LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *bu
                 return( -1);
             }   
 
-
+            //Convert back to host format, so the caller can check the reply
+            transfer = ntohll64(transfer);
         }
 
 
@@ -277,3 +283,82 @@ LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *bu
 }
 
 
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_readfull
+// Description  : Read exactly len bytes from the server connection, a reply
+//                that follows other replies back to back can arrive in pieces
+//
+// Inputs       : buf - where to put the bytes
+//                len - the number of bytes to read
+// Outputs      : 0 if successful, -1 if failure
+static int client_lcloud_readfull( void *buf, size_t len ) {
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len){
+        if ((n = read(socket_fd, (char *)buf + got, len - got)) <= 0){
+            return( -1 );
+        }
+        got += n;
+#ifdef TCP_QUICKACK
+        //ACK right away, the server holds back its next reply until this one is acknowledged
+        int one = 1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+#endif
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_readblocks
+// Description  : Send a batch of block read requests back to back and then
+//                collect all of the replies, so the whole batch costs one
+//                network round trip instead of one per block
+//
+// Inputs       : regs - the read request registers (LC_BLOCK_XFER/LC_XFER_READ)
+//                bufs - the 256-byte blocks to read into, one per request, the entry
+//                       of a block whose reply reports a failure is set to NULL
+//                count - the number of requests (at most LC_BUS_MAXBATCH)
+// Outputs      : number of blocks that failed (0 if all were read), -1 if the
+//                batch could not be sent or its replies read
+int client_lcloud_bus_readblocks( LCloudRegisterFrame *regs, char **bufs, int count ) {
+    uint64_t transfer[LC_BUS_MAXBATCH];
+    uint64_t rb0, rb1, rc0, rc1, rc2, rd0, rd1;
+    int failed = 0;
+
+    //The connection is made by the first (power on) request
+    if (socket_handle == -1 || count < 1 || count > LC_BUS_MAXBATCH){
+        return( -1 );
+    }
+
+    //Send every request in one write
+    for (int i=0; i<count; i++){
+        transfer[i] = htonll64(regs[i]);
+    }
+    if( write( socket_fd, transfer, sizeof(uint64_t) * count) != sizeof(uint64_t) * count ) {
+        printf( "Error writing network data [%s]\n", strerror(errno) );
+        return( -1);
+    }
+
+    //The server answers in order, each reply is the registers then the block
+    for (int i=0; i<count; i++){
+        if (client_lcloud_readfull(&transfer[i], sizeof(uint64_t)) != 0 ||
+            client_lcloud_readfull(bufs[i], 256) != 0){
+            printf( "Error reading network data [%s]\n", strerror(errno) );
+            return( -1);
+        }
+
+        //Check the reply registers, a block the device could not read is not handed back
+        extract_lcloud_registers(ntohll64(transfer[i]), &rb0, &rb1, &rc0, &rc1, &rc2, &rd0, &rd1);
+        if (rb0 != 1 || rb1 != 1 || rc0 != LC_BLOCK_XFER){
+            logMessage(LOG_ERROR_LEVEL, "LC failure reading block [%d/%d/%d] in a batch",
+             (int)((regs[i] >> 40) & 0xFF), (int)((regs[i] >> 16) & 0xFFFF), (int)(regs[i] & 0xFFFF));
+            bufs[i] = NULL;
+            failed++;
+        }
+    }
+    return (failed);
+}
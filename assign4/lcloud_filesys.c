@@ -16,6 +16,7 @@
 // Project include files
 #include <lcloud_filesys.h>
 #include <lcloud_controller.h>
+#include <lcloud_network.h>
 #include <lcloud_cache.h>
 #include <lcloud_support.h>
 
@@ -28,12 +29,17 @@ void extract_lcloud_registers(LCloudRegisterFrame resp, uint64_t *b0, uint64_t *
 
 int getDeviceID(uint64_t d0);
 
-int *writeblock(int devid, char *buf,  int sector, int block);
+int writeblock(int devid, char *buf,  int sector, int block);
 
-int *readblock(int devid, char *buf, int sector, int block);
+int readblock(int devid, char *buf, int sector, int block);
 
 int deviceInit();
 
+int loadblock(LcDeviceId did, uint16_t sec, uint16_t blk, char *block, void *arg);
+int flushblock(LcDeviceId did, uint16_t sec, uint16_t blk, char *block);
+int readcached(int devid, char *buf, int sector, int block, int around);
+int writecached(int devid, char *buf, int sector, int block, int around);
+
 //Declare global variables that hold the value of each register
 uint64_t b0, b1, c0, c1, c2, d0, d1;
 
@@ -111,29 +117,100 @@ void extract_lcloud_registers(LCloudRegisterFrame resp, uint64_t *b0, uint64_t *
 }
 
 
+//A run of a file's blocks that sit one after another in a sector of a device. Every block of
+// the run is full except the last, which holds fill bytes
+typedef struct {
+    size_t offset;
+    int start;
+    int count;
+    int device;
+    int sector;
+    int block;
+    int fill;
+}extent;
+
 //Declare a struct to be used to keep track of all information regarding to a specific file
 typedef struct {
-    char filename;
-    char pathname;
-    int length;
+    //Path the file was opened with (a copy), and the next open file in its path table bucket
+    char *path;
+    int pathnext;
+    size_t length;
     size_t pos;
     LcFHandle fhandle;
+    //Times the slot has been reused (the high bits of its handles), and the next closed slot on
+    // the free list
+    int generation;
+    int freenext;
     int size;
     int open;
-    int blocklist[1000];
-    int devicelist[1000];
-    int sectorlist[1000];
-    int writepos[1000];
-    int startwrite[1000];
-    int totalwritten[1000];
-    int writeamount[1000];
+    //Block map: the file offset and index of the first block of each run are kept so a block
+    // can be found by binary search. It grows as the file does, writecount is the file's blocks
+    extent *extents;
+    int extentcount;
+    int extentmax;
     int writecount;
-    int offset;
     int newblk;
+    //Readahead state: the block after the last read, the window size, the end of what has been
+    // read ahead and the wasted prefetch count when that was issued
+    int ranext;
+    int rawindow;
+    int raend;
+    int rawasted;
+    //Cache partition the file's blocks go in, -1 for the partition of the device they are on
+    int partition;
+    //Access pattern advice from lcadvise (normal, sequential or random) and the byte range advised
+    // not to be reused (kept out of the cache, empty when nrend is not past nrstart)
+    int advice;
+    size_t nrstart;
+    size_t nrend;
 }file;
 
-//Create an array of the file structs
-file instancearray[1000];
+//Create an array of the file structs, grown (doubled) when every slot is in use
+static file *instancearray = NULL;
+static int filecapacity = 0;
+
+//Closed slots waiting to be reused, oldest first, chained through freenext (-1 ends the list)
+static int freefile = -1;
+static int freetail = -1;
+
+//Path table: hash buckets of the open files' slots in instancearray, chained through pathnext
+// (-1 ends a chain), doubled when there are more open files than buckets
+static int *pathtable = NULL;
+static int pathbuckets = 0;
+static int pathcount = 0;
+
+//Blocks of a read that were fetched in the same bus batch as its readahead, loadblock hands
+// them to the cache when lcread asks for them
+typedef struct {
+    int count;
+    int devicelist[LC_BUS_MAXBATCH];
+    int sectorlist[LC_BUS_MAXBATCH];
+    int blocklist[LC_BUS_MAXBATCH];
+    char data[LC_BUS_MAXBATCH][256];
+}stagedblocks;
+
+//Path and handle table helpers
+int fileslot(void);
+void fileslotfree(int slot);
+uint32_t pathhash(const char *path);
+int pathfind(const char *path);
+int pathinsert(int slot);
+void pathremove(int slot);
+file *filebyhandle(LcFHandle fh);
+
+//Block map helpers, blocks are numbered from 0 in file order
+extent *fileextent(file *ptr, int k);
+void fileblockaddr(file *ptr, int k, int *dev, int *sec, int *blk);
+size_t fileblockend(file *ptr, int k);
+int fileblockfill(file *ptr, int k);
+int fileblockat(file *ptr, size_t off);
+int fileappend(file *ptr, int dev, int sec, int blk, int fill);
+
+//Readahead and advice helpers, they work on the file structs
+void filereadahead(file *ptr, int first, int last, int around, stagedblocks *stage);
+int prefetchblocks(file *ptr, int first, int last, int from, int to, stagedblocks *stage);
+int noreuse(file *ptr, size_t start, size_t len);
+char *fileblock(file *ptr, int k, stagedblocks *stage, char *scratch);
 
 //Declare a struct to be used to keep track of all information regarding to a specific device
 typedef struct {
@@ -141,26 +218,39 @@ typedef struct {
     int blocks;
     int sectors;
     int powerOn;
-    int blocknum;
-    int secnum;
-    int full;
     int pos;
-    int emptyamount;
-    int emptyblk[1000];
-    int emptysec[1000];
-    
+    //Free space: a bit per block (numbered sector * blocks + block) set while it is free, then a
+    // summary bit per word of that set while the word has a free block, and one set while every
+    // block of the word is free (where new runs start). cursor is the block the last run started at
+    uint64_t *freemap;
+    uint64_t *freewords;
+    uint64_t *emptywords;
+    int freecount;
+    int cursor;
 }device;
 
 
 //Create an array of device structs
 device devicearray[100];
 
+//Free space helpers, a device's blocks are numbered sector * blocks + block
+int freemapinit(device *dev);
+void freemapset(device *dev, int i, int isfree);
+int freemapfind(device *dev, int from, int run);
+int findbit(uint64_t *bits, int nbits, int from);
+int allocblock(file *ptr, int *dev, int *sec, int *blk);
+void releaseblock(int dev, int sec, int blk);
+int shortwrite(size_t len, size_t left);
+
 //Variable to keep track if power is on or not
 int powerOn = 0;
 
-//Counter variable to assign a unique file handle to each file
+//Number of slots handed out so far (open files and those on the free list)
 int file_counter = 0;
 
+//Largest readahead window (in blocks), 0 turns readahead off
+int lcloud_readahead = LC_READAHEAD_MAXBLOCKS;
+
 //instantiate a unique handle for each file
 LcFHandle fh;
 
@@ -196,27 +286,55 @@ LcFHandle lcopen( const char *path ) {
     //Initialize each of the devices
     deviceInit();
 
-    //Initialize the cache
-    lcloud_initcache(LC_CACHE_MAXBLOCKS);
+    //Initialize the cache, writing blocks out through flushblock, and tell it the devices so it only
+    //  warms up from a snapshot of these ones
+    LcCacheDevice cachedevs[LC_CACHE_MAXDEVICES];
+    for (int d = 0; d < devicecount && d < LC_CACHE_MAXDEVICES; d++){
+        cachedevs[d].id = devicearray[d].id;
+        cachedevs[d].sectors = devicearray[d].sectors;
+        cachedevs[d].blocks = devicearray[d].blocks;
+    }
+    lcloud_setcachedevices(cachedevs, devicecount);
+    lcloud_setcachewriter(flushblock);
+    lcloud_initcache(lcloud_cacheblocks);
     }
 
-    //Iteration Variable
-    int i;
-    
-    //Loop through the File Array and return error if the file is already open
-    for (i=0; i<file_counter; i++){
-        if (instancearray[i].filename == path){
-            return(-1);
-        }
+    //Look the path up in the path table and return error if the file is already open
+    if (pathfind(path) != -1){
+        return(-1);
     }
+    //Take a free slot (a closed file's, or a new one), the handle is its index and generation
+    int slot = fileslot();
+    if (slot == -1){
+        logMessage(LOG_ERROR_LEVEL, "Cannot open [%s], no file slot is free", path);
+        return(-1);
+    }
+    file *ptr = &instancearray[slot];
+    if ((ptr->path = strdup(path)) == NULL || pathinsert(slot) != 0){
+        free(ptr->path);
+        ptr->path = NULL;
+        fileslotfree(slot);
+        return(-1);
+    }
+
     //Create a Struct instance for this file
-    instancearray[file_counter].size = 0;
-    instancearray[file_counter].filename = *path;
-    instancearray[file_counter].fhandle = file_counter;
-    instancearray[file_counter].open = 1;
-    instancearray[file_counter].newblk = 0;
-    fh = instancearray[file_counter].fhandle;
-    file_counter++;
+    ptr->size = 0;
+    ptr->fhandle = (ptr->generation << LC_HANDLE_SLOTBITS) | slot;
+    ptr->open = 1;
+    ptr->newblk = 0;
+    ptr->extents = NULL;
+    ptr->extentcount = 0;
+    ptr->extentmax = 0;
+    ptr->writecount = 0;
+    ptr->ranext = 0;
+    ptr->rawindow = LC_READAHEAD_MINBLOCKS;
+    ptr->raend = 0;
+    ptr->rawasted = 0;
+    ptr->partition = -1;
+    ptr->advice = LC_ADVISE_NORMAL;
+    ptr->nrstart = 0;
+    ptr->nrend = 0;
+    fh = ptr->fhandle;
     
     // Return File Handle
     return (fh);   
@@ -235,19 +353,15 @@ LcFHandle lcopen( const char *path ) {
 // Outputs      : number of bytes read, -1 if failure
 int lcread( LcFHandle fh, char *buf, size_t len ) {
     //Declare local variables that will be used
-    int i, handle, currentcount;
+    int currentcount;
 
-    //loop through to find the file thats been passed
-    for (i=0; i< file_counter;i++){
-        if (instancearray[i].fhandle == fh && instancearray[i].open == 1){
-            //The specific file (f) that is open and passed through has fh of value i.
-            handle = i;
-            break;
-        }
-    }
+    //Pinned cache line of the block being copied out, or the block read around the cache
+    char *line, scratch[256];
+    int around;
 
-    //Creating a temporary buffer so I can transfer specific portions of a block to the final buffer
-    char localbuf[256];
+    //Blocks of this read fetched along with its readahead
+    stagedblocks stage;
+    stage.count = 0;
 
     //Create a temporary length value that we can use to keep track of how much of the total length we have left to read
     size_t templen = len;
@@ -255,11 +369,9 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
     // AmountRead variable is used to keep track of how much is read in total.  It will be returned at the end.
     size_t amountRead = 0;
 
-    //Create a pointer for the file we are using
-    file *ptr = &instancearray[handle];
-
-    // If file isnt open yet, return error
-    if (instancearray[fh].open == 0){ 
+    //Create a pointer for the file we are using, if file isnt open yet, return error
+    file *ptr = filebyhandle(fh);
+    if (ptr == NULL){ 
         return -1;
     }
 
@@ -267,24 +379,39 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
     if (len < 0){
         return -1;
     }   
-    int j = 0;
-    //Find the block where the amount in the file is first above the offset
-    while(instancearray[handle].totalwritten[j] <= ptr->pos){
-        j++;
+    //A read cannot go past the end of the file (the block map ends there)
+    if (ptr->pos >= ptr->length){
+        return 0;
+    }
+    if (len > ptr->length - ptr->pos){
+        len = ptr->length - ptr->pos;
+        templen = len;
     }
 
-    
-    currentcount = j;
+    //Cache the blocks this read brings in under the file's partition, counting them for the file,
+    // unless the file was advised not to reuse them (checked for the range actually read)
+    lcloud_usecachepartition(ptr->partition);
+    lcloud_usecachefile(ptr->fhandle & LC_HANDLE_SLOTMASK);
+    around = noreuse(ptr, ptr->pos, len);
+
+    //Find the block where the amount in the file is first above the offset
+    currentcount = fileblockat(ptr, ptr->pos);
+
+    //Find the last block this read touches (the one holding its last byte) and let readahead
+    // fetch what follows it
+    if (len > 0){
+        filereadahead(ptr, currentcount, fileblockat(ptr, ptr->pos + len - 1), around, &stage);
+    }
     
 
     //Difference between how much has been written and our start position
-    int startdiff = instancearray[handle].totalwritten[currentcount] - ptr->pos;
+    int startdiff = fileblockend(ptr, currentcount) - ptr->pos;
 
     //Find the position in the first block that we start reading
-    int startpos = instancearray[handle].writepos[currentcount] - startdiff;
+    int startpos = fileblockfill(ptr, currentcount) - startdiff;
     
     //Variable to keep track of position while reading
-    int position = instancearray[handle].startwrite[currentcount]+ startpos;
+    int position = startpos;
 
     //Update file position
     ptr->pos += len;
@@ -296,28 +423,25 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
     //Loop through the following cases as long as there is still data to be read
     while(templen >0){
         //If the length of the read is on more than one block
-        if (templen >= (instancearray[handle].writepos[currentcount]- (position%256))){
+        if (templen >= (fileblockfill(ptr, currentcount) - (position%256))){
             
-            //Try to get the data from cache, if it's not there, read from device and revise cache
-           if (lcloud_getcache(instancearray[handle].devicelist[currentcount], 
-            instancearray[handle].sectorlist[currentcount], 
-            instancearray[handle].blocklist[currentcount]) == NULL){
-                readblock(instancearray[handle].devicelist[currentcount], localbuf, instancearray[handle].sectorlist[currentcount], instancearray[handle].blocklist[currentcount]);
-                lcloud_putcache(instancearray[handle].devicelist[currentcount],instancearray[handle].sectorlist[currentcount], instancearray[handle].blocklist[currentcount], localbuf);
-            }
-            else{
-                memcpy(localbuf, lcloud_getcache(instancearray[handle].devicelist[currentcount], instancearray[handle].sectorlist[currentcount], instancearray[handle].blocklist[currentcount]), 256);
+            //Get the block pinned in the cache, reading it from the device on a miss
+            line = fileblock(ptr, currentcount, &stage, around ? scratch : NULL);
+            if (line == NULL){
+                return -1;
             }
 
-            //Copy what we need from the local buffer into the final buffer
-           
-            memcpy(&buf[amountRead], &localbuf[((position) % 256)], instancearray[handle].writepos[currentcount] - (position%256));
+            //Copy what we need straight from the cache line into the final buffer
+            memcpy(&buf[amountRead], &line[((position) % 256)], fileblockfill(ptr, currentcount) - (position%256));
+            if (line != scratch){
+                lcloud_unpincache(line);
+            }
             
             //Subtract the amount we just copied from templen, and whatever excess there is, will go back through the while loop
-            templen -=(instancearray[handle].writepos[currentcount] - (position%256));
+            templen -=(fileblockfill(ptr, currentcount) - (position%256));
             
             //Add the amount we just transfered to the total read.
-            amountRead += instancearray[handle].writepos[currentcount] - (position%256);
+            amountRead += fileblockfill(ptr, currentcount) - (position%256);
             
             //Update our position to the end of the block
             position += (256 - (position % 256));
@@ -327,23 +451,21 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
         }
 
         //If the templen stays on just one block
-        if (templen < (instancearray[handle].writepos[currentcount] - (position%256)) && templen > 0){
+        if (templen > 0 && templen < (fileblockfill(ptr, currentcount) - (position%256))){
             
             
-            //Try to get the data from cache, if it's not there, read from device and revise cache
-            if (lcloud_getcache(instancearray[handle].devicelist[currentcount], 
-            instancearray[handle].sectorlist[currentcount], 
-            instancearray[handle].blocklist[currentcount]) == NULL){
-                readblock(instancearray[handle].devicelist[currentcount], localbuf, instancearray[handle].sectorlist[currentcount], instancearray[handle].blocklist[currentcount]);
-                lcloud_putcache(instancearray[handle].devicelist[currentcount],instancearray[handle].sectorlist[currentcount], instancearray[handle].blocklist[currentcount], localbuf);
+            //Get the block pinned in the cache, reading it from the device on a miss
+            line = fileblock(ptr, currentcount, &stage, around ? scratch : NULL);
+            if (line == NULL){
+                return -1;
             }
-            else{
-                memcpy(localbuf, lcloud_getcache(instancearray[handle].devicelist[currentcount], instancearray[handle].sectorlist[currentcount], instancearray[handle].blocklist[currentcount]), 256);
+
+            //Copy what we need straight from the cache line into the final buffer
+            memcpy(&buf[amountRead], &line[((position) % 256)], templen);
+            if (line != scratch){
+                lcloud_unpincache(line);
             }
             
-            //Copy what we need from the local buffer into the final buffer 
-            memcpy(&buf[amountRead], &localbuf[((position) % 256)], templen);
-            
             //Update amountread
             amountRead += templen;
             
@@ -374,9 +496,7 @@ int maldone =0;
 //Declare the dynamic memory array
 char *memarr;
 
-//Variable to keep track of empty and refilled block
-int totalempty =0;
-int refilled = 0;
+//Variable to keep track of new blocks
 int newblk = 0;
 int fullcount = 0;
 
@@ -388,10 +508,15 @@ int fullcount = 0;
 // Inputs       : dev - file handle for the file to write to
 //                buf - pointer to data to write
 //                len - the length of the write
-// Outputs      : number of bytes written if successful test, -1 if failure
+// Outputs      : number of bytes written if successful test (fewer than len if the devices
+//                filled up partway), -1 if failure
 int lcwrite( LcFHandle fh, char *buf, size_t len ) {
-    //Variables for loop counters
-    int i, f, blocks, p, z, emptydev, emptyblock, emptysector;
+    //Variables for loop counters, and the free block found for the next block of the file
+    int blocks, emptydev, emptyblock, emptysector, around;
+
+    //The partially full block found (the last of its run), and where it is
+    extent *part;
+    int pdev, psec, pblk;
 
     //If there is a partially full block found, this will be 1 
     int foundpartial = 0;
@@ -407,26 +532,24 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
         memset(memarr," ", 256);
     }
 
-    //loop through to find the file thats been passed
-    for (i=0; i< file_counter;i++){
-        if (instancearray[i].fhandle == fh && instancearray[i].open == 1){
-            //The specific file (f) that is open and passed through has fh of value i.
-            f = i;
-            break;
-        }
-    }
     //Create a pointer for the file we are using
-    file *ptr = &instancearray[f];
+    file *ptr = filebyhandle(fh);
 
 
     //Create a temporary length value that we can use to keep track of how much of the total length we have left to write
     size_t templen = len;
 
     // If file isnt open yet, return error
-    if (ptr->open == 0){    
+    if (ptr == NULL){    
         return -1;
     }
 
+    //Cache the blocks this write puts out under the file's partition, counting them for the file,
+    // or write them around the cache if the file was advised not to reuse them
+    lcloud_usecachepartition(ptr->partition);
+    lcloud_usecachefile(ptr->fhandle & LC_HANDLE_SLOTMASK);
+    around = noreuse(ptr, ptr->pos, len);
+
     //Creating a temporary buffer so I can transfer specific portions of a written peice to be the final result
     char locbuf[256];
     
@@ -443,19 +566,16 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
         emptyblock = -1;
         emptydev = -1;
         emptysector = -1;
-        z = 0;
         int full = 0;
 
-        //Loop through all the blocks that we've written this file to
-        //  Look for one that is partially full
-        while (instancearray[f].writepos[z] != 0){
-            
-            if(instancearray[f].writepos[z] < 256){               
-                p = z;
-                foundpartial = 1;
-                break;
-            }
-            z++;
+        //Only the file's last block can be partially full (writes fill it before a new one is
+        //  taken), so just look at the end of the last run rather than walking every run
+        if (ptr->extentcount > 0 && ptr->extents[ptr->extentcount - 1].fill < 256){
+            part = &ptr->extents[ptr->extentcount - 1];
+            pdev = part->device;
+            psec = part->sector;
+            pblk = part->block + part->count - 1;
+            foundpartial = 1;
         }
         
 
@@ -464,67 +584,66 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
 
                 //if for some reason the block we find is outside of the alloted space, skip this entire process
                 for(int d = 0; d < devicecount;d++){
-                    if (devicearray[d].id == instancearray[f].devicelist[p]){
-                        if (devicearray[d].blocks == instancearray[f].blocklist[p] || devicearray[d].sectors == instancearray[f].sectorlist[p]){
+                    if (devicearray[d].id == pdev){
+                        if (devicearray[d].blocks == pblk || devicearray[d].sectors == psec){
                             foundpartial = 0;
                             full = 1;
                         }
                     }
                 }
                 //If we go past the end of the block
-                if (templen > (256 - instancearray[f].writepos[p]) && full == 0){
+                if (templen > (256 - part->fill) && full == 0){
 
-                    //Read whats already in the block and copy it to local buffer
-                    readblock(instancearray[f].devicelist[p], locbuf, instancearray[f].sectorlist[p], instancearray[f].blocklist[p]);
-                   
+                    //Read whats already in the block and copy it to local buffer (the file is left as it
+                    //  was if the block cannot be read or written)
+                    if (readcached(pdev, locbuf, psec, pblk, around) != 0){
+                        return(shortwrite(len, templen));
+                    }
 
-                    memcpy(&locbuf[instancearray[f].writepos[p]], &buf[transfer], (256 - instancearray[f].writepos[p]));
-                    transfer += (256 - instancearray[f].writepos[p]);
+                    memcpy(&locbuf[part->fill], &buf[transfer], (256 - part->fill));
 
-                    //Now that we know where to write to, we physically put the block into the cache and device memory
-                    lcloud_putcache(instancearray[f].devicelist[p], instancearray[f].sectorlist[p], instancearray[f].blocklist[p], locbuf);
-                    writeblock(instancearray[f].devicelist[p], locbuf, instancearray[f].sectorlist[p], instancearray[f].blocklist[p]);
+                    //Now that we know where to write to, we write the block through the cache (held dirty in write-back mode)
+                    if (writecached(pdev, locbuf, psec, pblk, around) != 0){
+                        return(shortwrite(len, templen));
+                    }
+                    transfer += (256 - part->fill);
                     //memset(locbuf, 0, 256);
 
                     //Use a temporary length to keep track of excess buffer that hasnt been written yet, it will be written
                     // in the next block
-                    templen -= (256 - instancearray[f].writepos[p]);
-
-                    //Update total written and the written position
-                    instancearray[f].totalwritten[p] +=(256 - instancearray[f].writepos[p]);
+                    templen -= (256 - part->fill);
 
                     //keep track of the read/head and length of the file
-                    ptr->pos += (256 - instancearray[f].writepos[p]);
-                    ptr->length += (256 - instancearray[f].writepos[p]);
+                    ptr->pos += (256 - part->fill);
+                    ptr->length += (256 - part->fill);
 
-                    //Update the original block write length
-                    instancearray[f].writepos[p] = 256;
+                    //Update the original block write length (the block map works out the total written from it)
+                    part->fill = 256;
 
                     
             
                 }
 
                 //If we stay inside that block
-                if (templen <= (256 - instancearray[f].writepos[p]) && full == 0){
+                if (templen <= (256 - part->fill) && full == 0){
                     
                     //Read whats already in the block and copy it to local buffer
-                    readblock(instancearray[f].devicelist[p], locbuf, instancearray[f].sectorlist[p], instancearray[f].blocklist[p]);
-                    
+                    if (readcached(pdev, locbuf, psec, pblk, around) != 0){
+                        return(shortwrite(len, templen));
+                    }
                     
-                    memcpy(&locbuf[instancearray[f].writepos[p]], &buf[transfer],templen);
-                    transfer += templen;
+                    memcpy(&locbuf[part->fill], &buf[transfer],templen);
 
 
-                    //Now that we know where to write to, we physically put the block into the cache and device memory
-                    lcloud_putcache(instancearray[f].devicelist[p], instancearray[f].sectorlist[p], instancearray[f].blocklist[p], locbuf);
-                    writeblock(instancearray[f].devicelist[p], locbuf, instancearray[f].sectorlist[p], instancearray[f].blocklist[p]);
+                    //Now that we know where to write to, we write the block through the cache (held dirty in write-back mode)
+                    if (writecached(pdev, locbuf, psec, pblk, around) != 0){
+                        return(shortwrite(len, templen));
+                    }
+                    transfer += templen;
                     //memset(locbuf, 0, 256);
 
                     //Update total written in block 
-                    instancearray[f].writepos[p] += templen;
-
-                    //Update total written
-                    instancearray[f].totalwritten[p] +=templen;
+                    part->fill += templen;
 
                     //keep track of the read/head and length of the file
                     ptr->pos += templen;
@@ -552,59 +671,20 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
                     
                    memcpy(locbuf, &buf[len - templen], 256);
 
-                    //Look for empty blocks that are due to file closing
-                    for(int d = 0; d < devicecount; d++){
-                        if (devicearray[d].emptyamount >0){
-                            for(int e = 1; e < devicearray[d].emptyamount;e++){
-                                //Find the first empty block
-                                emptyblock = devicearray[d].emptyblk[e-1];
-                                emptysector = devicearray[d].emptysec[e-1];
-                                emptydev = devicearray[d].id;
-
-                                //Remove this block from the empty array
-                                for(int c = (e-1); c<(devicearray[d].emptyamount-1); c++){
-                                    devicearray[d].emptyblk[c] = devicearray[d].emptyblk[c+1];
-                                }
-
-                                //Update how many blocks are empty
-                                devicearray[d].emptyamount -=1;
-                                totalempty -= 1;
-                                refilled += 1;
-
-                                break;
-                            }
-                            break;
-                        }
+                    //Find a free block, the one after the file's last block if it is free so the file runs on
+                    //  (if none is left, report the short write of what already landed)
+                    if (allocblock(ptr, &emptydev, &emptysector, &emptyblock) != 0){
+                        return(shortwrite(len, templen));
                     }
-                    
-                    //If an empty block was found, use this
-                    if (emptyblock != -1 && emptydev != -1 && emptysector != -1){
 
-                    //Now that we know where to write to, we physically put the block into the cache and device memory
-                    lcloud_putcache(emptydev, emptysector, emptyblock, locbuf);
-                    writeblock(emptydev, locbuf, emptysector, emptyblock);
-                    //memset(locbuf, 0, 256);
-
-
-                    //Record where we wrote for read functionality
-                    instancearray[f].startwrite[instancearray[f].writecount] = 0;
-                    instancearray[f].writepos[instancearray[f].writecount] = 256;
-                    instancearray[f].writeamount[instancearray[f].writecount] = 256;
-                    instancearray[f].devicelist[instancearray[f].writecount] = emptydev;
-                    instancearray[f].sectorlist[instancearray[f].writecount] = emptysector;
-                    instancearray[f].blocklist[instancearray[f].writecount] = emptyblock;
-
-                    //If this is the first write, the total written is just the 256
-                    // If not the first write, it is the 256 added to the previous totalwritten
-                    if (instancearray[f].writecount == 0){
-                        instancearray[f].totalwritten[instancearray[f].writecount] =256;
-                    }
-                    else{
-                        instancearray[f].totalwritten[instancearray[f].writecount] =256 + instancearray[f].totalwritten[instancearray[f].writecount -1];
+                    //Now that we know where to write to, we write the block through the cache (held dirty in write-back mode),
+                    //  and record where we wrote for read functionality (giving the block back if either fails)
+                    if (writecached(emptydev, locbuf, emptysector, emptyblock, around) != 0 ||
+                        fileappend(ptr, emptydev, emptysector, emptyblock, 256) != 0){
+                        lcloud_dropcache(emptydev, emptysector, emptyblock);
+                        releaseblock(emptydev, emptysector, emptyblock);
+                        return(shortwrite(len, templen));
                     }
-                    
-                    //Update how many times we have written from this file
-                    instancearray[f].writecount ++;
 
                     //keep track of the read/head and length of the file
                     ptr->pos += (size_t) 256;
@@ -614,80 +694,6 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
                     //Use a temporary length to keep track of excess buffer that hasnt been written yet, it will be written
                     // in the next block
                     templen -= (size_t) 256;
-                    
-                    }
-
-                    //If no empty block was found, proceed as normal
-                    else{
-
-                    //Check to make sure device isnt full
-                        for (int y = 0; y<devicecount; y++){
-                            if (devicearray[devcount].full ==1){
-                                devcount += 1;
-                                
-                                if (devcount >=devicecount){
-                                    devcount = 0;
-                                }
-                            }
-                            else{
-                                break;
-                            }
-                        }
-
-                   
-                        //Record where we wrote for read functionality
-                    instancearray[f].startwrite[instancearray[f].writecount] = 0;
-                    instancearray[f].writepos[instancearray[f].writecount] = 256;
-                    instancearray[f].writeamount[instancearray[f].writecount] = 256;
-                    instancearray[f].devicelist[instancearray[f].writecount] = devicearray[devcount].id;
-                    instancearray[f].sectorlist[instancearray[f].writecount] = devicearray[devcount].secnum;
-                    instancearray[f].blocklist[instancearray[f].writecount] = devicearray[devcount].blocknum;
-
-                    //Now that we know where to write to, we physically put the block into the cache and device memory
-                    lcloud_putcache(devicearray[devcount].id, devicearray[devcount].secnum, devicearray[devcount].blocknum, locbuf);
-                    writeblock(devicearray[devcount].id, locbuf, devicearray[devcount].secnum, devicearray[devcount].blocknum);
-                    //memset(locbuf, 0, 256);
-
-                    //If this is the first write, the total written is just the 256
-                    // If not the first write, it is the 256 added to the previous totalwritten
-                    if (instancearray[f].writecount == 0){
-                        instancearray[f].totalwritten[instancearray[f].writecount] =256;
-                    }
-                    else{
-                        instancearray[f].totalwritten[instancearray[f].writecount] =256 + instancearray[f].totalwritten[instancearray[f].writecount -1];
-                    }
-                    
-                    //Update how many times we have written from this file
-                    instancearray[f].writecount ++;
-
-                    //keep track of the read/head and length of the file
-                    ptr->pos += (size_t) 256;
-                    ptr->length += (size_t) 256;
-                    
-
-                    //Use a temporary length to keep track of excess buffer that hasnt been written yet, it will be written
-                    // in the next block
-                    templen -= (size_t) 256;
-
-                    //Update the block we are on
-                    devicearray[devcount].blocknum += 1;
-
-                    //Check to make sure were not going past available space
-                    if (devicearray[devcount].blocknum >= devicearray[devcount].blocks){
-                        devicearray[devcount].secnum += 1;
-                        devicearray[devcount].blocknum = 0;
-                    }
-                    if (devicearray[devcount].secnum >= devicearray[devcount].sectors){
-                        devicearray[devcount].full = 1;
-                    }
-                    //Go to the next device for the upcoming write
-                    devcount+=1;
-                    //Since we only have 5 devices, go back to the first after the fifth
-                    if (devcount >=devicecount){
-                        devcount = 0;
-                    }
-                    
-                    }
                 }
             }
             //Starting at the beginning of a new block and Going less than to the end of the block
@@ -695,104 +701,20 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
                
                memcpy(locbuf, &buf[len - templen], templen);
 
-                //Look for empty blocks that are due to file closing
-                    for(int d = 0; d < devicecount; d++){
-                        if (devicearray[d].emptyamount >0){
-                            for(int e = 1; e < devicearray[d].emptyamount;e++){
-                                //Find the first empty block
-                                emptyblock = devicearray[d].emptyblk[e-1];
-                                emptysector = devicearray[d].emptysec[e-1];
-                                emptydev = devicearray[d].id;
-
-                                //Remove this block from the empty array
-                                for(int c = (e-1); c<(devicearray[d].emptyamount-1); c++){
-                                    devicearray[d].emptyblk[c] = devicearray[d].emptyblk[c+1];
-                                }
-
-                                //Update how many blocks are empty
-                                devicearray[d].emptyamount -=1;
-                                totalempty -=1;
-                                refilled +=1;
-
-                                break;
-                            }
-                            break;
-                        }
-                    }
-                    
-                    //If an empty block was found, use this
-                    if (emptyblock != -1 && emptydev != -1 && emptysector != -1){
-                        
-                        //Now that we know where to write to, we put the block into the cache and the device
-                        lcloud_putcache(emptydev, emptysector, emptyblock, locbuf);
-                        writeblock(emptydev, locbuf, emptysector, emptyblock);
-                        
-                        //Update all of the file information for the write
-                        instancearray[f].startwrite[instancearray[f].writecount] = 0;
-                        instancearray[f].writepos[instancearray[f].writecount] = templen;
-                        instancearray[f].writeamount[instancearray[f].writecount] = templen;
-                        instancearray[f].devicelist[instancearray[f].writecount] = emptydev;
-                        instancearray[f].sectorlist[instancearray[f].writecount] = emptysector;
-                        instancearray[f].blocklist[instancearray[f].writecount] = emptyblock;
-
-                        //If this is the first write, the total written is just the templen
-                        // If not the first write, it is the templen added to the previous totalwritten
-                        if ( instancearray[f].writecount== 0){
-                            instancearray[f].totalwritten[instancearray[f].writecount] =templen;
-                        }
-                        else{
-                            instancearray[f].totalwritten[instancearray[f].writecount] =templen + instancearray[f].totalwritten[instancearray[f].writecount -1];
-                        }
-                        //Update how many times we have written from this file
-                        instancearray[f].writecount++;
-                        //keep track of the read/head and length of the file
-                        ptr->pos += (size_t) templen;
-                
-                        ptr->length += (size_t) templen;
-
-                        //Use a temporary length to keep track of excess buffer that hasnt been written yet, it will be written
-                        // in the next block
-                        templen -= templen;
+                //Find a free block, the one after the file's last block if it is free so the file runs on
+                //  (if none is left, report the short write of what already landed)
+                if (allocblock(ptr, &emptydev, &emptysector, &emptyblock) != 0){
+                    return(shortwrite(len, templen));
+                }
 
-                        transfer = 0;
-                    }
-                    else{
-
-                    //Check if device is full
-                    for (int y = 0; y<devicecount; y++){
-                        if (devicearray[devcount].full ==1){
-                            devcount += 1;
-                            if (devcount >=devicecount){
-                                devcount = 0;
-                            }
-                        }
-                        else{
-                            break;
-                        }
-                    }
-                   
-                    //Update all of the file information for the write
-                instancearray[f].startwrite[instancearray[f].writecount] = 0;
-                instancearray[f].writepos[instancearray[f].writecount] = templen;
-                instancearray[f].writeamount[instancearray[f].writecount] = templen;
-                instancearray[f].devicelist[instancearray[f].writecount] = devicearray[devcount].id;
-                instancearray[f].sectorlist[instancearray[f].writecount] = devicearray[devcount].secnum;
-                instancearray[f].blocklist[instancearray[f].writecount] = devicearray[devcount].blocknum;
-
-                //Now that we know where to write to, we put the block into the cache and the device
-                lcloud_putcache(devicearray[devcount].id, devicearray[devcount].secnum, devicearray[devcount].blocknum, locbuf);
-                writeblock(devicearray[devcount].id, locbuf, devicearray[devcount].secnum, devicearray[devcount].blocknum);
-                
-                //If this is the first write, the total written is just the templen
-                // If not the first write, it is the templen added to the previous totalwritten
-                if ( instancearray[f].writecount== 0){
-                        instancearray[f].totalwritten[instancearray[f].writecount] =templen;
-                    }
-                    else{
-                        instancearray[f].totalwritten[instancearray[f].writecount] =templen + instancearray[f].totalwritten[instancearray[f].writecount -1];
-                    }
-                //Update how many times we have written from this file
-                instancearray[f].writecount++;
+                //Now that we know where to write to, we put the block into the cache and the device, then
+                //  update all of the file information for the write (giving the block back if either fails)
+                if (writecached(emptydev, locbuf, emptysector, emptyblock, around) != 0 ||
+                    fileappend(ptr, emptydev, emptysector, emptyblock, templen) != 0){
+                    lcloud_dropcache(emptydev, emptysector, emptyblock);
+                    releaseblock(emptydev, emptysector, emptyblock);
+                    return(shortwrite(len, templen));
+                }
                 //keep track of the read/head and length of the file
                 ptr->pos += (size_t) templen;
                 
@@ -801,29 +723,8 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
                 //Use a temporary length to keep track of excess buffer that hasnt been written yet, it will be written
                 // in the next block
                 templen -= templen;
-            
-                //Update the block we are on
-                devicearray[devcount].blocknum += 1;
 
-                //Check to make sure were not going past available space
-                if (devicearray[devcount].blocknum >= devicearray[devcount].blocks){
-                    devicearray[devcount].secnum += 1;
-                    devicearray[devcount].blocknum = 0;
-                }
-                if (devicearray[devcount].secnum >= devicearray[devcount].sectors){
-                    devicearray[devcount].full = 1;
-                }
-                //Go to the next device for the upcoming write
-                    devcount+=1;
-                //Since we only have 5 devices, go back to the first after the fifth
-                if (devcount >=devicecount){
-                        devcount = 0;
-                    }
                 transfer = 0;
-                }   
-                
-                    
-                
             }
             if (templen == 0){
                 return(len);
@@ -843,34 +744,131 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
 //
 // Inputs       : fh - the file handle of the file to seek in
 //                off - offset within the file to seek to
-// Outputs      : position if successful test, -1 if failure
+// Outputs      : 0 if successful test, -1 if failure (the position is a size_t, it would not fit
+//                the int return of files past 2 GB)
 int lcseek( LcFHandle fh, size_t off ) {
-    int i, f;
-    for (i=0; i< file_counter;i++){
-        if (instancearray[i].fhandle == fh && instancearray[i].open == 1){
-            //The specific file (f) that is open and passed through has fh of value i.
-            f = i;
-            break;
-        }
-    }
-
     //Create a pointer that can point to the variables of a specific pointer
-    file *ptr = &instancearray[f];
+    file *ptr = filebyhandle(fh);
    
-    //If the offset is greater than the length of the file, return an error
-    if (off > ptr->length){
+    //If the file is not open or the offset is greater than the length of the file, return an error
+    if (ptr == NULL || off > ptr->length){
         return -1;
     }
 
     //Positioning the read/write head at the desired offset.
     ptr->pos = off;
-    ptr->offset = off;
      
-    return(ptr->offset);
+    return(0);
     
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcpartition
+// Description  : Put the blocks of a file in a cache partition (see lcloud_setcachequota)
+//
+// Inputs       : fh - the file handle of the file
+//                part - the cache partition, -1 to use the partition of each block's device
+// Outputs      : 0 if successful, -1 if failure
+int lcpartition( LcFHandle fh, int part ) {
+    file *ptr = filebyhandle(fh);
+
+    //If the file is not open or the partition does not exist, return an error
+    if (ptr == NULL || part < -1 || part >= LC_CACHE_MAXPARTS){
+        return -1;
+    }
+    ptr->partition = part;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcadvise
+// Description  : Tell the cache how a range of a file will be used (like posix_fadvise).
+//                Sequential, random and normal advice is for the whole file and sets how
+//                it is read ahead. Willneed reads the range into the cache now, dontneed
+//                writes back and drops its cached blocks, and noreuse reads and writes the
+//                range around the cache (replacing any earlier noreuse range).
+//
+// Inputs       : fh - the file handle of the file
+//                off - offset of the start of the range
+//                len - length of the range, 0 for to the end of the file
+//                advice - the LC_ADVISE_ advice
+// Outputs      : 0 if successful, -1 if failure
+int lcadvise( LcFHandle fh, size_t off, size_t len, LcAdvice advice ) {
+    stagedblocks stage;
+    size_t end = (len == 0) ? (size_t)-1 : off + len;
+    int first, last, to, dev, sec, blk, failed = 0;
+    file *ptr = filebyhandle(fh);
+    char *line;
+
+    //If the file is not open or the advice is unknown, return an error
+    if (ptr == NULL || advice < LC_ADVISE_NORMAL || advice > LC_ADVISE_NOREUSE){
+        return -1;
+    }
+    lcloud_usecachepartition(ptr->partition);
+    lcloud_usecachefile(ptr->fhandle & LC_HANDLE_SLOTMASK);
+
+    //Find the blocks of the file's block map the range covers (first up to but not including last)
+    first = (off < ptr->length) ? fileblockat(ptr, off) : ptr->writecount;
+    last = (end < ptr->length) ? fileblockat(ptr, end - 1) + 1 : ptr->writecount;
+
+    switch (advice){
+    case LC_ADVISE_NORMAL: // Back to adapting readahead to the reads and caching every block
+        ptr->advice = advice;
+        ptr->rawindow = LC_READAHEAD_MINBLOCKS;
+        ptr->nrstart = 0;
+        ptr->nrend = 0;
+        break;
+
+    case LC_ADVISE_SEQUENTIAL: // Readahead follows the file's advice from the next read on
+    case LC_ADVISE_RANDOM:
+        ptr->advice = advice;
+        break;
+
+    case LC_ADVISE_WILLNEED: // Read the range in a bus batch at a time, then any block still missing
+        for (int k=first; k<last; k=to){
+            to = (k + LC_BUS_MAXBATCH < last) ? k + LC_BUS_MAXBATCH : last;
+            stage.count = 0;
+            if (prefetchblocks(ptr, k, k - 1, k, to, &stage) != 0){
+                return -1;
+            }
+        }
+        for (int k=first; k<last; k++){
+            fileblockaddr(ptr, k, &dev, &sec, &blk);
+            if (!lcloud_incache(dev, sec, blk)){
+                if ((line = lcloud_getorloadcache(dev, sec, blk, loadblock, NULL)) == NULL){
+                    return -1;
+                }
+                lcloud_unpincache(line);
+            }
+        }
+        break;
+
+    case LC_ADVISE_DONTNEED: // Give the range's lines back to the cache (a pinned block stays, a
+                             //  dirty one that cannot be written back fails the advice)
+        for (int k=first; k<last; k++){
+            fileblockaddr(ptr, k, &dev, &sec, &blk);
+            if (lcloud_evictcache(dev, sec, blk) == -1){
+                failed = 1;
+            }
+        }
+        if (failed){
+            return -1;
+        }
+        break;
+
+    case LC_ADVISE_NOREUSE: // Reads and writes of the range from now on go around the cache
+        ptr->nrstart = off;
+        ptr->nrend = end;
+        break;
+    }
+    return 0;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcclose
@@ -879,46 +877,49 @@ int lcseek( LcFHandle fh, size_t off ) {
 // Inputs       : fh - the file handle of the file to close
 // Outputs      : 0 if successful test, -1 if failure
 int lcclose( LcFHandle fh ) {
-    int i,  f, j, dev, sector, block;
+    int j, dev, sector, block;
+    file *ptr = filebyhandle(fh);
 
     char emptybuf[256];
     memset(emptybuf, "\0", 256);
-    for (i=0; i< file_counter;i++){
-        if (instancearray[i].fhandle == fh){
-            //The specific file (f) that is open and passed through has fh of value i.
-            f = i;
-            break;
-        }
-    }
 
 
     //If file is closed, return error
-    if (instancearray[f].open == 0){
+    if (ptr == NULL){
         return -1;
     }
-    //If file is open, make it closed
-    instancearray[f].open = 0; 
+    //If file is open, make it closed, its path can be opened again
+    ptr->open = 0; 
+    pathremove(ptr->fhandle & LC_HANDLE_SLOTMASK);
+    free(ptr->path);
+    ptr->path = NULL;
     
     //Clear the memory from the device where that file was opened, since we cannot access it anymore
-    for (j=0;j<instancearray[f].writecount;j++){
-        writeblock(instancearray[f].devicelist[j],emptybuf, instancearray[f].sectorlist[j], instancearray[f].blocklist[j]);
-        
+    for (j=0;j<ptr->writecount;j++){
         //Keep track of what block is now free
-        dev = instancearray[f].devicelist[j];
-        block = instancearray[f].blocklist[j];
-        sector = instancearray[f].sectorlist[j];
-
-        //Allow us to rewrite to this block later incase we run out of space
-        for(int d = 0; d < devicecount;d++){
-            if (devicearray[d].id == dev){
-                devicearray[d].emptyamount +=1;
-                devicearray[d].emptyblk[devicearray[d].emptyamount-1] = block;
-                devicearray[d].emptysec[devicearray[d].emptyamount-1] = sector;
-                totalempty += 1;
-            }
-        }
+        fileblockaddr(ptr, j, &dev, &sector, &block);
+
+        //Drop any cached (possibly dirty) copy so a later flush cannot overwrite the cleared block
+        lcloud_dropcache(dev, sector, block);
+        writeblock(dev, emptybuf, sector, block);
+
+        //Allow us to rewrite to this block later
+        releaseblock(dev, sector, block);
+    }
+
+    //The block map goes with the file
+    free(ptr->extents);
+    ptr->extents = NULL;
+    ptr->extentcount = 0;
+    ptr->extentmax = 0;
+    ptr->writecount = 0;
+
+    //Put the slot on the free list, its next handle will not match this one (old handles are rejected),
+    //  unless its generations have run out, then it is retired so no old handle ever matches again
+    ptr->generation = (ptr->generation + 1) & LC_HANDLE_GENMASK;
+    if (ptr->generation != 0){
+        fileslotfree(ptr->fhandle & LC_HANDLE_SLOTMASK);
     }
-    
     
     return( 0 );
     
@@ -933,23 +934,47 @@ int lcclose( LcFHandle fh ) {
 // Inputs       : none
 // Outputs      : 0 if successful test, -1 if failure
 int lcshutdown( void ) {
+    int closed;
+
     //Free the dynamic memory
     free(memarr);
 
-    //Close the cache
-    lcloud_closecache();
+    //Close the cache, it fails if dirty blocks could not be written back (the shutdown goes on)
+    closed = lcloud_closecache();
 
     //Power off devices
     LCloudRegisterFrame frm = create_lcloud_registers(0,0, LC_POWER_OFF, 0, 0, 0, 0);
     client_lcloud_bus_request(frm, NULL);
 
-    //Close all Files
+    //Free the devices' free space maps
+    for (int d = 0; d < devicecount; d++){
+        free(devicearray[d].freemap);
+        free(devicearray[d].freewords);
+        free(devicearray[d].emptywords);
+        devicearray[d].freemap = devicearray[d].freewords = devicearray[d].emptywords = NULL;
+    }
+
+    //Close all Files, freeing their paths and block maps
     for (int i = 0; i <file_counter ; i++){
         if (instancearray[i].open == 1){
             instancearray[i].open = 0;
+            free(instancearray[i].path);
+            instancearray[i].path = NULL;
+            free(instancearray[i].extents);
+            instancearray[i].extents = NULL;
         }
     }
-    return( 0 );
+    free(instancearray);
+    instancearray = NULL;
+    filecapacity = 0;
+    file_counter = 0;
+    freefile = -1;
+    freetail = -1;
+    free(pathtable);
+    pathtable = NULL;
+    pathbuckets = 0;
+    pathcount = 0;
+    return( closed );
     
 }
 
@@ -962,7 +987,8 @@ int lcshutdown( void ) {
 // Inputs       : devid - the ID of the device we want to write to
 //                buf - the actual value of what we are righting into the block
 // Outputs      : 0 if successful, -1 if failure
-int *writeblock(int devid, char *buf, int sector, int block){
+int writeblock(int devid, char *buf, int sector, int block){
+    uint64_t rb0, rb1, rc0, rc1, rc2, rd0, rd1;
     int i;
     for (i=0; i<devicecount;i++){
         if (devicearray[i].id == devid){
@@ -978,8 +1004,16 @@ int *writeblock(int devid, char *buf, int sector, int block){
     //Pack the registers with a write operator and what and where to write
     frm= create_lcloud_registers(0, 0, LC_BLOCK_XFER, devid, LC_XFER_WRITE, sector, block);
     
-    //Calling the bus function
-    client_lcloud_bus_request(frm, buf);
+    //Calling the bus function, and checking the reply (the block did not land if it failed)
+    if ((frm = client_lcloud_bus_request(frm, buf)) == (LCloudRegisterFrame)-1){
+        logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc[%d/%d/%d], bus request failed.", devid, sector, block );
+        return( -1 );
+    }
+    extract_lcloud_registers(frm, &rb0, &rb1, &rc0, &rc1, &rc2, &rd0, &rd1);
+    if ((rb0 != 1) || (rb1 != 1) || (rc0 != LC_BLOCK_XFER)){
+        logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc[%d/%d/%d].", devid, sector, block );
+        return( -1 );
+    }
 
     return (0);   
 }
@@ -1023,22 +1057,875 @@ int getDeviceID(uint64_t d0){
 // Inputs       : devid - the ID of the device we want to write to
 //                buf - the actual value of what we are reading from the block
 // Outputs      : 0 if successful, -1 if failure
-int *readblock(int devid, char *buf, int sector, int block){
+int readblock(int devid, char *buf, int sector, int block){
     LCloudRegisterFrame frm;
+    uint64_t rb0, rb1, rc0, rc1, rc2, rd0, rd1;
     
     //Pack the registers with a read operator and what and where to read
     frm= create_lcloud_registers(0, 0, LC_BLOCK_XFER, devid, LC_XFER_READ, sector, block);
-    //if ( (frm== -1) || ((frm= client_lcloud_bus_request(frm, buf)) == -1) ||(b0 != 1) || (b1 != 1) || (c0 != LC_BLOCK_XFER) ) {
-    //logMessage( LOG_ERROR_LEVEL, "LC failure writing blkc[%d/%d/%d].", devid, sector, block );
-    //return( -1 );
-    //}
-    //Calling the bus function 
-    client_lcloud_bus_request(frm, buf);
 
+    //Calling the bus function, and checking the reply (the buffer holds nothing useful if it failed)
+    if ((frm = client_lcloud_bus_request(frm, buf)) == (LCloudRegisterFrame)-1){
+        logMessage( LOG_ERROR_LEVEL, "LC failure reading blkc[%d/%d/%d], bus request failed.", devid, sector, block );
+        return( -1 );
+    }
+    extract_lcloud_registers(frm, &rb0, &rb1, &rc0, &rc1, &rc2, &rd0, &rd1);
+    if ((rb0 != 1) || (rb1 != 1) || (rc0 != LC_BLOCK_XFER)){
+        logMessage( LOG_ERROR_LEVEL, "LC failure reading blkc[%d/%d/%d].", devid, sector, block );
+        return( -1 );
+    }
+
+    return (0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadblock
+// Description  : cache loader that reads a missed block from the device straight into the cache line,
+//                or copies it from the blocks already fetched with a readahead batch
+//
+// Inputs       : did - the ID of the device to read from
+//                sec - the sector of the block
+//                blk - the block number
+//                block - the cache line buffer to fill
+//                arg - the read's stagedblocks, or NULL
+// Outputs      : 0 if successful, -1 if failure
+int loadblock(LcDeviceId did, uint16_t sec, uint16_t blk, char *block, void *arg){
+    stagedblocks *stage = (stagedblocks *)arg;
+
+    if (stage != NULL){
+        for (int i=0; i<stage->count; i++){
+            if (stage->devicelist[i] == did && stage->sectorlist[i] == sec && stage->blocklist[i] == blk){
+                memcpy(block, stage->data[i], 256);
+                return (0);
+            }
+        }
+    }
+    return (readblock(did, block, sec, blk));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flushblock
+// Description  : cache writer that sends a block (write-through or a flushed dirty line) to the device
+//
+// Inputs       : did - the ID of the device to write to
+//                sec - the sector of the block
+//                blk - the block number
+//                block - the block to write
+// Outputs      : 0 if successful, -1 if failure
+int flushblock(LcDeviceId did, uint16_t sec, uint16_t blk, char *block){
+    return (writeblock(did, block, sec, blk));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pathhash
+// Description  : hash a path for the path table (32 bit FNV-1a)
+//
+// Inputs       : path - the path
+// Outputs      : the hash
+uint32_t pathhash(const char *path){
+    uint32_t hash = 2166136261u;
+
+    while (*path != '\0'){
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    }
+    return (hash);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pathfind
+// Description  : look a path up in the path table
+//
+// Inputs       : path - the path
+// Outputs      : slot of the open file with that path, -1 if none is open
+int pathfind(const char *path){
+    if (pathbuckets == 0){
+        return (-1);
+    }
+    for (int i = pathtable[pathhash(path) & (pathbuckets - 1)]; i != -1; i = instancearray[i].pathnext){
+        if (strcmp(instancearray[i].path, path) == 0){
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pathinsert
+// Description  : add an open file to the path table under its path, doubling the buckets (and
+//                rehashing the open files into them) when there would be more files than buckets
+//
+// Inputs       : slot - slot of the file in instancearray
+// Outputs      : 0 if successful, -1 if failure
+int pathinsert(int slot){
+    int *grown, buckets, bucket;
+
+    if (pathcount + 1 > pathbuckets){
+        buckets = (pathbuckets > 0) ? pathbuckets * 2 : 64;
+        if ((grown = (int *)malloc(sizeof(int) * buckets)) == NULL){
+            logMessage(LOG_ERROR_LEVEL, "Failed to grow the path table to %d buckets", buckets);
+            return (-1);
+        }
+        for (int b = 0; b < buckets; b++){
+            grown[b] = -1;
+        }
+
+        //Move each chain over a file at a time
+        for (int b = 0; b < pathbuckets; b++){
+            for (int i = pathtable[b], next; i != -1; i = next){
+                next = instancearray[i].pathnext;
+                bucket = pathhash(instancearray[i].path) & (buckets - 1);
+                instancearray[i].pathnext = grown[bucket];
+                grown[bucket] = i;
+            }
+        }
+        free(pathtable);
+        pathtable = grown;
+        pathbuckets = buckets;
+    }
+
+    bucket = pathhash(instancearray[slot].path) & (pathbuckets - 1);
+    instancearray[slot].pathnext = pathtable[bucket];
+    pathtable[bucket] = slot;
+    pathcount++;
+    return (0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pathremove
+// Description  : take a file out of the path table when it is closed
+//
+// Inputs       : slot - slot of the file in instancearray
+// Outputs      : none
+void pathremove(int slot){
+    int *link = &pathtable[pathhash(instancearray[slot].path) & (pathbuckets - 1)];
+
+    while (*link != -1){
+        if (*link == slot){
+            *link = instancearray[slot].pathnext;
+            pathcount--;
+            return;
+        }
+        link = &instancearray[*link].pathnext;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : filebyhandle
+// Description  : find an open file by its handle (the low bits of the handle are the file's slot
+//                in instancearray, the high bits the slot's generation when it was opened)
+//
+// Inputs       : fh - the file handle
+// Outputs      : the file, NULL if the handle is not that of an open file (a handle of a closed
+//                file whose slot was reused is stale, its generation does not match)
+file *filebyhandle(LcFHandle fh){
+    file *ptr;
+
+    if (fh < 0 || (fh & LC_HANDLE_SLOTMASK) >= file_counter){
+        return (NULL);
+    }
+    ptr = &instancearray[fh & LC_HANDLE_SLOTMASK];
+    if (ptr->open == 0 || ptr->fhandle != fh){
+        return (NULL);
+    }
+    return (ptr);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileslot
+// Description  : take a slot for a file being opened. Unused room in instancearray is taken
+//                first, then the slot closed longest ago, and only then is instancearray doubled,
+//                so opening and closing files in a loop goes round every slot rather than
+//                wearing out one slot's generations.
+//
+// Inputs       : none
+// Outputs      : the slot, cleared but for its generation, -1 if failure
+int fileslot(void){
+    int slot, capacity, generation;
+    file *grown;
+
+    if (freefile != -1 && file_counter == filecapacity){
+        slot = freefile;
+        freefile = instancearray[slot].freenext;
+        if (freefile == -1){
+            freetail = -1;
+        }
+    }
+    else{
+        if (file_counter == filecapacity){
+            capacity = (filecapacity > 0) ? filecapacity * 2 : 64;
+            if (capacity > LC_HANDLE_SLOTMASK + 1){
+                capacity = LC_HANDLE_SLOTMASK + 1;
+            }
+            if (capacity == filecapacity || (grown = (file *)realloc(instancearray, sizeof(file) * capacity)) == NULL){
+                logMessage(LOG_ERROR_LEVEL, "Failed to grow the file table past %d slots", filecapacity);
+                return (-1);
+            }
+            instancearray = grown;
+            filecapacity = capacity;
+        }
+        slot = file_counter++;
+        instancearray[slot].generation = 0;
+    }
+
+    generation = instancearray[slot].generation;
+    memset(&instancearray[slot], 0, sizeof(file));
+    instancearray[slot].generation = generation;
+    return (slot);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileslotfree
+// Description  : put a slot at the back of the free list, to be reused after every slot
+//                closed before it
+//
+// Inputs       : slot - the slot
+// Outputs      : none
+void fileslotfree(int slot){
+    instancearray[slot].freenext = -1;
+    if (freetail == -1){
+        freefile = slot;
+    }
+    else{
+        instancearray[freetail].freenext = slot;
+    }
+    freetail = slot;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileextent
+// Description  : find the run of a file's block map a block is in (binary search on the runs'
+//                first block indexes)
+//
+// Inputs       : ptr - the file
+//                k - index of the block in the file, below its writecount
+// Outputs      : the run
+extent *fileextent(file *ptr, int k){
+    int lo = 0, hi = ptr->extentcount - 1, mid;
+
+    //Find the last run that starts at or before the block
+    while (lo < hi){
+        mid = (lo + hi + 1) / 2;
+        if (ptr->extents[mid].start <= k){
+            lo = mid;
+        }
+        else{
+            hi = mid - 1;
+        }
+    }
+    return (&ptr->extents[lo]);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileblockaddr
+// Description  : find where a block of a file is on the devices
+//
+// Inputs       : ptr - the file
+//                k - index of the block in the file
+//                dev, sec, blk - set to the device, sector and block number of the block
+// Outputs      : none
+void fileblockaddr(file *ptr, int k, int *dev, int *sec, int *blk){
+    extent *run = fileextent(ptr, k);
+
+    *dev = run->device;
+    *sec = run->sector;
+    *blk = run->block + (k - run->start);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileblockend
+// Description  : find the file offset just past the last byte written in a block of a file
+//                (the total written up to and including the block)
+//
+// Inputs       : ptr - the file
+//                k - index of the block in the file
+// Outputs      : the offset
+size_t fileblockend(file *ptr, int k){
+    extent *run = fileextent(ptr, k);
+
+    return (run->offset + (size_t)(k - run->start) * 256 + fileblockfill(ptr, k));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileblockfill
+// Description  : find how many bytes have been written in a block of a file
+//
+// Inputs       : ptr - the file
+//                k - index of the block in the file
+// Outputs      : the bytes written, 256 for a full block
+int fileblockfill(file *ptr, int k){
+    extent *run = fileextent(ptr, k);
+
+    return ((k == run->start + run->count - 1) ? run->fill : 256);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileblockat
+// Description  : find the block of a file holding a byte (binary search on the runs' file
+//                offsets, then a divide within the run, whose blocks are full but the last)
+//
+// Inputs       : ptr - the file
+//                off - offset of the byte, below the file's length
+// Outputs      : index of the block in the file
+int fileblockat(file *ptr, size_t off){
+    int lo = 0, hi = ptr->extentcount - 1, mid;
+    extent *run;
+
+    //Find the last run that starts at or before the byte
+    while (lo < hi){
+        mid = (lo + hi + 1) / 2;
+        if (ptr->extents[mid].offset <= off){
+            lo = mid;
+        }
+        else{
+            hi = mid - 1;
+        }
+    }
+    run = &ptr->extents[lo];
+    return (run->start + (((off - run->offset) / 256 < (size_t)run->count) ? (int)((off - run->offset) / 256) : run->count - 1));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileappend
+// Description  : add a block to the end of a file's block map, extending the last run when the
+//                block comes right after it on the same device and sector, and growing the map
+//                (doubling it) when a new run does not fit
+//
+// Inputs       : ptr - the file
+//                dev, sec, blk - where the block is
+//                fill - bytes written in the block
+// Outputs      : 0 if successful, -1 if failure
+int fileappend(file *ptr, int dev, int sec, int blk, int fill){
+    extent *run = (ptr->extentcount > 0) ? &ptr->extents[ptr->extentcount - 1] : NULL;
+    extent *grown;
+    int max;
+
+    //Only a run whose last block is full can take another block
+    if (run != NULL && run->fill == 256 && run->device == dev && run->sector == sec && run->block + run->count == blk){
+        run->count++;
+        run->fill = fill;
+        ptr->writecount++;
+        return (0);
+    }
+
+    if (ptr->extentcount == ptr->extentmax){
+        max = (ptr->extentmax > 0) ? ptr->extentmax * 2 : 16;
+        if ((grown = (extent *)realloc(ptr->extents, sizeof(extent) * max)) == NULL){
+            logMessage(LOG_ERROR_LEVEL, "Failed to grow the block map of file %d to %d runs", ptr->fhandle, max);
+            return (-1);
+        }
+        ptr->extents = grown;
+        ptr->extentmax = max;
+        run = (ptr->extentcount > 0) ? &ptr->extents[ptr->extentcount - 1] : NULL;
+    }
+
+    //The new run starts where the last one's data ends
+    grown = &ptr->extents[ptr->extentcount];
+    grown->offset = (run != NULL) ? run->offset + (size_t)(run->count - 1) * 256 + run->fill : 0;
+    grown->start = ptr->writecount;
+    grown->count = 1;
+    grown->device = dev;
+    grown->sector = sec;
+    grown->block = blk;
+    grown->fill = fill;
+    ptr->extentcount++;
+    ptr->writecount++;
     return (0);
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readcached
+// Description  : read a block through the cache into a local buffer (for read-modify-write)
+//
+// Inputs       : devid - the ID of the device to read from
+//                buf - the buffer to copy the block into
+//                sector - the sector of the block
+//                block - the block number
+//                around - 1 to read a block that is not cached straight from the device, leaving it out
+// Outputs      : 0 if successful, -1 if failure
+int readcached(int devid, char *buf, int sector, int block, int around){
+    char *line;
+
+    if (around){
+        return ((lcloud_peekcache(devid, sector, block, buf) == 0) ? 0 : loadblock(devid, sector, block, buf, NULL));
+    }
+    if ((line = lcloud_getorloadcache(devid, sector, block, loadblock, NULL)) == NULL){
+        return (-1);
+    }
+    memcpy(buf, line, 256);
+    lcloud_unpincache(line);
+    return (0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writecached
+// Description  : write a block through the cache, or around it (dropping any cached copy and
+//                writing the device) for blocks advised not to be reused
+//
+// Inputs       : devid - the ID of the device to write to
+//                buf - the block to write
+//                sector - the sector of the block
+//                block - the block number
+//                around - 1 to write around the cache
+// Outputs      : 0 if successful, -1 if failure
+int writecached(int devid, char *buf, int sector, int block, int around){
+    //A pinned copy cannot be dropped, that block goes through the cache after all
+    if (around && lcloud_dropcache(devid, sector, block) == 0){
+        return (flushblock(devid, sector, block, buf));
+    }
+    return (lcloud_writecache(devid, sector, block, buf));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileblock
+// Description  : get a block of a file for a read, pinned in the cache (read from the device on a
+//                miss), or with a scratch buffer read around the cache: a cached copy (in a line
+//                or any tier) is copied into it without being promoted or counted, and a block
+//                that is not cached is read into it and left out
+//
+// Inputs       : ptr - the file
+//                k - index of the block in the file's block map
+//                stage - the read's staged blocks
+//                scratch - buffer to read around the cache into, NULL to go through it
+// Outputs      : the block (a pinned cache line, or scratch), NULL if failure
+char *fileblock(file *ptr, int k, stagedblocks *stage, char *scratch){
+    int dev, sec, blk;
+
+    fileblockaddr(ptr, k, &dev, &sec, &blk);
+    if (scratch == NULL){
+        return (lcloud_getorloadcache(dev, sec, blk, loadblock, stage));
+    }
+    if (lcloud_peekcache(dev, sec, blk, scratch) != 0 && loadblock(dev, sec, blk, scratch, stage) != 0){
+        return (NULL);
+    }
+    return (scratch);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : noreuse
+// Description  : check whether a byte range of a file overlaps the range it was advised
+//                LC_ADVISE_NOREUSE for
+//
+// Inputs       : ptr - the file
+//                start - offset of the first byte of the range
+//                len - length of the range
+// Outputs      : 1 if it does, 0 if not
+int noreuse(file *ptr, size_t start, size_t len){
+    return (ptr->nrend > ptr->nrstart && start < ptr->nrend && start + len > ptr->nrstart);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : filereadahead
+// Description  : when reads of a file are sequential, read the next blocks of its block map
+//                into the cache before they are asked for. The window doubles while the
+//                prefetched blocks get used and halves when they are evicted unused. Blocks
+//                of the read itself that are not cached go in the same bus batch. Files
+//                advised sequential always read ahead the largest window, and files advised
+//                random (or reads advised not to be reused) never read ahead.
+//
+// Inputs       : ptr - the file being read
+//                first - index of the first block of the read in the file's block map
+//                last - index of the last block of the read
+//                around - 1 if the read is kept out of the cache
+//                stage - where to put the blocks of the read that get fetched
+// Outputs      : none
+void filereadahead(file *ptr, int first, int last, int around, stagedblocks *stage){
+    int used, wasted, maxwindow, from, end = last + 1;
+
+    //Keep the window to a quarter of the cache so readahead cannot flush out the working set
+    maxwindow = (lcloud_readahead < lcloud_cacheblocks / 4) ? lcloud_readahead : lcloud_cacheblocks / 4;
+    if (maxwindow > LC_BUS_MAXBATCH - (last + 1 - first)){
+        maxwindow = LC_BUS_MAXBATCH - (last + 1 - first);
+    }
+    if (maxwindow < 1){
+        return;
+    }
+
+    //Going back to the start of the file begins a new sequential stream
+    if (first == 0 && ptr->ranext > 1 && !around && ptr->advice != LC_ADVISE_RANDOM){
+        ptr->raend = 0;
+    }
+
+    //A read that does not start where the last one ended (or at the start of the file) is random,
+    // nothing is read ahead for it, nor for any read where the advice says not to
+    else if (around || ptr->advice == LC_ADVISE_RANDOM ||
+             (ptr->advice != LC_ADVISE_SEQUENTIAL && first != 0 && first != ptr->ranext && first != ptr->ranext - 1)){
+        ptr->ranext = last + 1;
+        ptr->raend = last + 1;
+        prefetchblocks(ptr, first, last, end, end, stage);
+        return;
+    }
+    ptr->ranext = last + 1;
+
+    //Issue the next window once the reader is within half a window of the end of the last one
+    if (ptr->raend - (last + 1) <= ptr->rawindow / 2 && last + 1 < ptr->writecount){
+
+        //Size the window by how the last one went, read ahead blocks evicted unused since then mean the
+        // cache cannot hold them until they are read. The window can shrink to nothing, then readahead
+        // stays off for this file until it is reopened (it is read too slowly for readahead to pay)
+        lcloud_prefetchstats(&used, &wasted);
+        if (ptr->advice == LC_ADVISE_SEQUENTIAL){
+            ptr->rawindow = maxwindow;
+        }
+        else if (ptr->raend > 0){
+            if (wasted > ptr->rawasted){
+                ptr->rawindow /= 2;
+            }
+            else{
+                ptr->rawindow = (ptr->rawindow * 2 < maxwindow) ? ptr->rawindow * 2 : maxwindow;
+            }
+        }
+        if (ptr->rawindow > maxwindow){
+            ptr->rawindow = maxwindow;
+        }
+        ptr->rawasted = wasted;
+
+        //The window runs after whatever is already read ahead, up to the end of the file
+        end = last + 1 + ptr->rawindow;
+        if (end > ptr->writecount){
+            end = ptr->writecount;
+        }
+    }
+    from = (ptr->raend > last + 1) ? ptr->raend : last + 1;
+    if (end > ptr->raend){
+        ptr->raend = end;
+    }
+    prefetchblocks(ptr, first, last, from, end, stage);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetchblocks
+// Description  : read the blocks of a read and a range after it that are not cached with one batch
+//                of bus requests, staging the read's blocks and putting the others in the cache
+//
+// Inputs       : ptr - the file
+//                first, last - indexes of the first and last blocks of the read
+//                from - index of the first block to read ahead
+//                to - index after the last block to read ahead
+//                stage - where to put the blocks of the read
+// Outputs      : 0 if successful, -1 if failure
+int prefetchblocks(file *ptr, int first, int last, int from, int to, stagedblocks *stage){
+    LCloudRegisterFrame regs[LC_BUS_MAXBATCH];
+    char blocks[LC_BUS_MAXBATCH][256];
+    char *bufs[LC_BUS_MAXBATCH];
+    int index[LC_BUS_MAXBATCH], dev[LC_BUS_MAXBATCH], sec[LC_BUS_MAXBATCH], blk[LC_BUS_MAXBATCH];
+    int count = 0, demand;
+
+    //Build a read request for each block the cache does not have, the read's own blocks first
+    for (int k=first; k<to && count<LC_BUS_MAXBATCH; k++){
+        //Skip from the read to the readahead range (which can be empty, ending where the read does)
+        if (k > last && k < from){
+            k = from;
+        }
+        if (k >= to){
+            break;
+        }
+        fileblockaddr(ptr, k, &dev[count], &sec[count], &blk[count]);
+        if (lcloud_incache(dev[count], sec[count], blk[count])){
+            continue;
+        }
+        regs[count] = create_lcloud_registers(0, 0, LC_BLOCK_XFER, dev[count], LC_XFER_READ, sec[count], blk[count]);
+        index[count] = k;
+        count++;
+    }
+
+    //A single block is left to the normal miss path
+    if (count < 2){
+        return (0);
+    }
+
+    //Blocks of the read land in the stage, the rest in a local buffer on their way to the cache
+    demand = 0;
+    for (int i=0; i<count; i++){
+        if (index[i] <= last){
+            bufs[i] = stage->data[demand];
+            stage->devicelist[demand] = dev[i];
+            stage->sectorlist[demand] = sec[i];
+            stage->blocklist[demand] = blk[i];
+            demand++;
+        }
+        else{
+            bufs[i] = blocks[i];
+        }
+    }
+
+    //Send them all at once and hand the read ahead blocks to the cache, leaving out any block
+    // the device failed to read (a staged one is left for the normal miss path to read again)
+    if (client_lcloud_bus_readblocks(regs, bufs, count) == -1){
+        logMessage(LOG_ERROR_LEVEL, "Readahead of %d blocks failed", count);
+        return (-1);
+    }
+    stage->count = demand;
+    for (int i=0; i<count; i++){
+        if (bufs[i] == NULL){
+            if (i < demand){
+                stage->devicelist[i] = -1;
+            }
+        }
+        else if (i >= demand){
+            lcloud_prefetchcache(dev[i], sec[i], blk[i], blocks[i]);
+        }
+    }
+    return (0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freemapinit
+// Description  : set up a device's free space map with every block free
+//
+// Inputs       : dev - the device, its sectors and blocks set
+// Outputs      : 0 if successful, -1 if failure
+int freemapinit(device *dev){
+    int n = dev->sectors * dev->blocks, words = (n + 63) / 64, summary = (words + 63) / 64;
+
+    dev->freemap = (uint64_t *)calloc(words > 0 ? words : 1, sizeof(uint64_t));
+    dev->freewords = (uint64_t *)calloc(summary > 0 ? summary : 1, sizeof(uint64_t));
+    dev->emptywords = (uint64_t *)calloc(summary > 0 ? summary : 1, sizeof(uint64_t));
+    if (dev->freemap == NULL || dev->freewords == NULL || dev->emptywords == NULL){
+        logMessage(LOG_ERROR_LEVEL, "Failed to allocate the free space map of device %d (%d blocks)", dev->id, n);
+        return (-1);
+    }
+    dev->freecount = 0;
+    dev->cursor = 0;
+    for (int i = 0; i < n; i++){
+        freemapset(dev, i, 1);
+    }
+    return (0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freemapset
+// Description  : mark a block of a device free or used, keeping the summaries in step
+//
+// Inputs       : dev - the device
+//                i - the block (sector * blocks + block)
+//                isfree - 1 to mark it free, 0 used
+// Outputs      : none
+void freemapset(device *dev, int i, int isfree){
+    int w = i / 64, n = dev->sectors * dev->blocks;
+    uint64_t bit = 1ULL << (i % 64), whole;
+
+    if (((dev->freemap[w] & bit) != 0) == isfree){
+        return;
+    }
+    if (isfree){
+        dev->freemap[w] |= bit;
+        dev->freecount++;
+    }
+    else{
+        dev->freemap[w] &= ~bit;
+        dev->freecount--;
+    }
+
+    //The last word only has the device's remaining blocks in it
+    whole = (w == (n - 1) / 64 && n % 64 != 0) ? (1ULL << (n % 64)) - 1 : ~0ULL;
+    if (dev->freemap[w] != 0){
+        dev->freewords[w / 64] |= 1ULL << (w % 64);
+    }
+    else{
+        dev->freewords[w / 64] &= ~(1ULL << (w % 64));
+    }
+    if (dev->freemap[w] == whole){
+        dev->emptywords[w / 64] |= 1ULL << (w % 64);
+    }
+    else{
+        dev->emptywords[w / 64] &= ~(1ULL << (w % 64));
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findbit
+// Description  : find the first set bit of a bitmap at or after a bit, wrapping around to the start
+//
+// Inputs       : bits - the bitmap
+//                nbits - bits in it
+//                from - bit to start at
+// Outputs      : the bit, -1 if none is set
+int findbit(uint64_t *bits, int nbits, int from){
+    int words = (nbits + 63) / 64, w = from / 64;
+    uint64_t word;
+
+    //The rest of the starting word, the other words, then the start of the starting word
+    if ((word = bits[w] & (~0ULL << (from % 64))) != 0){
+        return (w * 64 + __builtin_ctzll(word));
+    }
+    for (int k = 1; k <= words; k++){
+        w = (from / 64 + k) % words;
+        if ((word = bits[w]) != 0){
+            return (w * 64 + __builtin_ctzll(word));
+        }
+    }
+    return (-1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freemapfind
+// Description  : find a free block of a device from the summaries, searching on from a block
+//
+// Inputs       : dev - the device
+//                from - block to search from
+//                run - 1 to only take the first block of a word that is all free (room for a run),
+//                      0 to take any free block
+// Outputs      : the block, -1 if none was found
+int freemapfind(device *dev, int from, int run){
+    int n = dev->sectors * dev->blocks, words = (n + 63) / 64, w;
+
+    if (dev->freecount == 0 || n == 0){
+        return (-1);
+    }
+    if (run){
+        w = findbit(dev->emptywords, words, (from / 64 + 1) % words);
+        return ((w == -1) ? -1 : w * 64);
+    }
+
+    //A free block left in the starting word comes first, then the first one in the next word with any
+    if ((dev->freemap[from / 64] >> (from % 64)) != 0){
+        return (from + __builtin_ctzll(dev->freemap[from / 64] >> (from % 64)));
+    }
+    w = findbit(dev->freewords, words, (from / 64 + 1) % words);
+    return ((w == -1) ? -1 : w * 64 + __builtin_ctzll(dev->freemap[w]));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocblock
+// Description  : find and take a free block for the next block of a file. The block after the
+//                file's last one comes first, so the file's blocks run on in its block map. Else a
+//                new run starts in an all free word (going round the devices so files spread over
+//                them), and once the devices are too full for that, any free block is taken.
+//
+// Inputs       : ptr - the file
+//                dev, sec, blk - set to where the block is
+// Outputs      : 0 if successful, -1 if every device is full
+int allocblock(file *ptr, int *dev, int *sec, int *blk){
+    extent *run;
+    device *d;
+    int i;
+
+    if (ptr->extentcount > 0){
+        run = &ptr->extents[ptr->extentcount - 1];
+        for (int k = 0; k < devicecount; k++){
+            d = &devicearray[k];
+            i = run->sector * d->blocks + run->block + run->count;
+            if (d->id == run->device && i < d->sectors * d->blocks && (d->freemap[i / 64] & (1ULL << (i % 64))) != 0){
+                freemapset(d, i, 0);
+                *dev = d->id;
+                *sec = i / d->blocks;
+                *blk = i % d->blocks;
+                return (0);
+            }
+        }
+    }
+
+    //Go round the devices from the next one in turn, looking for room for a run and then for any block
+    for (int pass = 1; pass >= 0; pass--){
+        for (int k = 0; k < devicecount; k++){
+            d = &devicearray[(devcount + k) % devicecount];
+            if ((i = freemapfind(d, d->cursor, pass)) == -1){
+                continue;
+            }
+            freemapset(d, i, 0);
+            d->cursor = i;
+            devcount = (devcount + k + 1) % devicecount;
+            *dev = d->id;
+            *sec = i / d->blocks;
+            *blk = i % d->blocks;
+            return (0);
+        }
+    }
+    logMessage(LOG_ERROR_LEVEL, "No free block left on any device for file %d", ptr->fhandle);
+    return (-1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releaseblock
+// Description  : give a block back to its device's free space
+//
+// Inputs       : dev - the device
+//                sec - the sector of the block
+//                blk - the block number
+// Outputs      : none
+void releaseblock(int dev, int sec, int blk){
+    for (int d = 0; d < devicecount; d++){
+        if (devicearray[d].id == dev && devicearray[d].freemap != NULL){
+            freemapset(&devicearray[d], sec * devicearray[d].blocks + blk, 1);
+            return;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shortwrite
+// Description  : work out what a write that stopped partway (no block could be added to the
+//                file, or a block could not be read or written) returns, the bytes that
+//                landed (the file's length and position already count them)
+//
+// Inputs       : len - the length of the write
+//                left - the bytes of it not written
+// Outputs      : number of bytes written, -1 if none were
+int shortwrite(size_t len, size_t left){
+    if (left >= len){
+        logMessage(LOG_ERROR_LEVEL, "Write failed, nothing was written to the file");
+        return (-1);
+    }
+    logMessage(LOG_ERROR_LEVEL, "Short write, only %d of %d bytes written", (int)(len - left), (int)len);
+    return ((int)(len - left));
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : deviceInit
@@ -1062,6 +1949,11 @@ int deviceInit(){
     extract_lcloud_registers(bus, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
     devicearray[i].blocks = d1;
     devicearray[i].sectors = d0;
+
+    //Every block starts out free
+    if (freemapinit(&devicearray[i]) != 0){
+        return (-1);
+    }
     }
     return (0);
 }
\ No newline at end of file
@@ -16,10 +16,36 @@
 #include <stdint.h>
 
 // Defines 
+#define LC_READAHEAD_MINBLOCKS 2  // Readahead window a sequential stream starts with
+#define LC_READAHEAD_MAXBLOCKS 32 // Default largest readahead window (in blocks)
+#define LC_HANDLE_SLOTBITS 16 // Low bits of a file handle that hold its file table slot
+#define LC_HANDLE_SLOTMASK ((1 << LC_HANDLE_SLOTBITS) - 1) // Slot of a handle, limits the open files (65536)
+#define LC_HANDLE_GENMASK ((1 << (31 - LC_HANDLE_SLOTBITS)) - 1) // Generations a slot goes through before it is retired
+
+// The file table grows (doubling) as files are opened, up to 65536 slots, which is as many
+// files as can be open at once; the handle is a positive int32_t, so more slot bits would
+// cost generation bits. The other 15 bits of a handle hold its slot's generation, bumped each
+// time the slot is closed, so a handle kept past lcclose is rejected. Closed slots are reused
+// oldest first, and a slot is retired rather than reused once its 32768 generations run out,
+// so an old handle never becomes valid again.
 
 // Type definitions
 typedef int32_t LcFHandle;
 
+/* Access pattern advice for lcadvise (after posix_fadvise) */
+typedef enum {
+    LC_ADVISE_NORMAL     = 0, // No advice, readahead adapts to the reads (clears the others)
+    LC_ADVISE_SEQUENTIAL = 1, // The file is read in order, read ahead the largest window
+    LC_ADVISE_RANDOM     = 2, // The file is read out of order, do not read ahead
+    LC_ADVISE_WILLNEED   = 3, // The range will be read soon, read it into the cache now
+    LC_ADVISE_DONTNEED   = 4, // The range will not be read again soon, drop it from the cache
+    LC_ADVISE_NOREUSE    = 5  // The range is read or written once, keep it out of the cache
+} LcAdvice;
+
+// Global data
+
+extern int lcloud_readahead; // Largest readahead window in blocks, 0 turns readahead off
+
 // File system interface definitions
 
 LcFHandle lcopen( const char *path );
@@ -32,7 +58,13 @@ int lcwrite( LcFHandle fh, char *buf, size_t len );
     // Write data to the file
 
 int lcseek( LcFHandle fh, size_t off );
-    // Seek to a specific place in the file
+    // Seek to a specific place in the file, 0 if successful, -1 if failure
+
+int lcpartition( LcFHandle fh, int part );
+    // Put the file's blocks in a cache partition
+
+int lcadvise( LcFHandle fh, size_t off, size_t len, LcAdvice advice );
+    // Tell the cache how a range of the file (len 0 for to the end) will be used
 
 int lcclose( LcFHandle fh );
     // Close the file
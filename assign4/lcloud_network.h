@@ -21,6 +21,7 @@
 #define LCLOUD_NET_HEADER_SIZE sizeof(LCloudRegisterFrame)
 #define LCLOUD_DEFAULT_IP "127.0.0.1"
 #define LCLOUD_DEFAULT_PORT 24567
+#define LC_BUS_MAXBATCH 64 // Most reads client_lcloud_bus_readblocks sends at once
 
 // Global data
 
@@ -31,5 +32,9 @@ LCloudRegisterFrame client_lcloud_bus_request(LCloudRegisterFrame reg, void *buf
 	// This is the implementation of the client operation, as implemented 
 	//  by the 311 student code.
 
+int client_lcloud_bus_readblocks(LCloudRegisterFrame *regs, char **bufs, int count);
+	// Send a batch of block reads back to back and collect the replies,
+	//  one network round trip for the whole batch.
+
 
 #endif
@@ -17,25 +17,41 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 // Project Includes
+#include <lcloud_cache.h>
 #include <lcloud_controller.h>
 #include <lcloud_filesys.h>
 #include <lcloud_support.h>
 
 // Defines
-#define LCLOUD_ARGUMENTS "hvl:x:"
+#define LCLOUD_ARGUMENTS "hvwtgl:c:p:s:a:f:z:d:b:m:n:i:x:"
 #define USAGE                                                       \
-    "USAGE: lcloud_sim [-h] [-v] [-l <logfile>] <workload-file>\n"  \
+    "USAGE: lcloud_sim [-h] [-v] [-w] [-t] [-g] [-l <logfile>] [-c <blocks>] [-p <policy>] [-s <shards>] [-a <blocks>] [-f <snapshot>] [-z <kbytes>] [-d <file>] [-b <blocks>] [-m <name>] [-n <blocks>] [-i <ops>] <workload-file>\n" \
     "\n"                                                            \
     "where:\n"                                                      \
     "    -h - help mode (display this message)\n"                   \
     "    -v - verbose output\n"                                     \
+    "    -w - write-back cache (hold writes until eviction/shutdown)\n" \
+    "    -t - TinyLFU admission (new blocks only evict more recently popular ones)\n" \
+    "    -g - keep the cache on the heap instead of a huge page arena\n" \
     "    -l - write log messages to the filename <logfile>\n"       \
+    "    -c - size of the block cache in blocks (default 64)\n"     \
+    "    -p - cache replacement policy: lru, clock, 2q, arc or lfu\n" \
+    "    -s - number of independently locked cache shards (default 1)\n" \
+    "    -a - largest sequential readahead window in blocks, 0 for none (default 32)\n" \
+    "    -f - cache snapshot file, loaded at startup and saved at shutdown\n" \
+    "    -z - memory for the compressed cache tier in kilobytes (default 0, none)\n" \
+    "    -d - local file for the disk cache tier, memory mapped (default none)\n" \
+    "    -b - size of the disk cache tier in blocks (default 65536)\n" \
+    "    -m - POSIX shared memory name for a cache tier shared by clients on this host (default none)\n" \
+    "    -n - size of the shared memory tier in blocks, if this client creates it (default 16384)\n" \
+    "    -i - log the cache statistics every <ops> workload operations (default 0, never)\n" \
     "\n"                                                            \
     "    <workload-file> - file contain the workload to simulate\n" \
     "\n"
@@ -43,11 +59,13 @@
 //
 // Global Data
 int verbose;
+int statsinterval = 0; // Workload operations between cache statistics dumps, 0 for none
 
 //
 // Functional Prototypes
 
 int simulateLionCloud(char* wload); // LionCloud simulation
+void dumpCacheStats(int ops); // Log the cache statistics during the run
 
 //
 // Functions
@@ -84,6 +102,94 @@ int main(int argc, char* argv[])
             log_initialized = 1;
             break;
 
+        case 'c': // Set the cache size
+            lcloud_cacheblocks = atoi(optarg);
+            if (lcloud_cacheblocks < 1) {
+                fprintf(stderr, "Bad cache size [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'w': // Use a write-back cache
+            lcloud_cachewriteback = 1;
+            break;
+
+        case 'g': // Keep the cache off huge pages
+            lcloud_cachehugepages = 0;
+            break;
+
+        case 't': // Use the TinyLFU admission filter
+            lcloud_cacheadmission = 1;
+            break;
+
+        case 'p': // Set the cache replacement policy
+            if ((ch = lcloud_cachepolicybyname(optarg)) == -1) {
+                fprintf(stderr, "Unknown cache policy [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            lcloud_cachepolicy = ch;
+            break;
+
+        case 's': // Set the number of cache shards
+            lcloud_cacheshards = atoi(optarg);
+            if (lcloud_cacheshards < 1 || lcloud_cacheshards > LC_CACHE_MAXSHARDS) {
+                fprintf(stderr, "Bad cache shard count [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'a': // Set the readahead window
+            lcloud_readahead = atoi(optarg);
+            if (lcloud_readahead < 0) {
+                fprintf(stderr, "Bad readahead window [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'f': // Set the cache snapshot file
+            lcloud_cachesnapshot = optarg;
+            break;
+
+        case 'z': // Set the compressed tier size
+            lcloud_cachezbytes = atoi(optarg) * 1024;
+            if (lcloud_cachezbytes < 0) {
+                fprintf(stderr, "Bad compressed tier size [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'i': // Set the cache statistics interval
+            statsinterval = atoi(optarg);
+            if (statsinterval < 0) {
+                fprintf(stderr, "Bad statistics interval [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'd': // Set the disk tier file
+            lcloud_cachel2file = optarg;
+            break;
+
+        case 'b': // Set the disk tier size
+            lcloud_cachel2blocks = atoi(optarg);
+            if (lcloud_cachel2blocks < 1) {
+                fprintf(stderr, "Bad disk tier size [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'm': // Set the shared memory tier name
+            lcloud_cacheshmname = optarg;
+            break;
+
+        case 'n': // Set the shared memory tier size
+            lcloud_cacheshmblocks = atoi(optarg);
+            if (lcloud_cacheshmblocks < 1) {
+                fprintf(stderr, "Bad shared memory tier size [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
         default: // Default (unknown)
             fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
             return (-1);
@@ -147,7 +253,7 @@ int simulateLionCloud(char* wload)
     LcFHandle fh;
     AssocArray fhTable;
     char buf[LC_MAX_OPERATION_SIZE];
-    int opens, reads, writes, seeks, closes;
+    int opens, reads, writes, seeks, closes, ops = 0;
     fsysdata* fdata;
 
     /* Init fh table, open the workload for processing */
@@ -210,7 +316,7 @@ int simulateLionCloud(char* wload)
 
             /* If the position within the file is not a read location, seek */
             if (fdata->pos != operation.pos) {
-                if (lcseek(fdata->fhandle, operation.pos) != operation.pos) {
+                if (lcseek(fdata->fhandle, operation.pos) != 0) {
                     logMessage(LOG_ERROR_LEVEL, "CMPSC311 error seek failed [%s, pos=%d], aborting",
                         operation.objname, operation.pos);
                     return (-1);
@@ -252,7 +358,7 @@ int simulateLionCloud(char* wload)
 
             /* If the position within the file is not a read location, seek */
             if (fdata->pos != operation.pos) {
-                if (lcseek(fdata->fhandle, operation.pos) != operation.pos) {
+                if (lcseek(fdata->fhandle, operation.pos) != 0) {
                     logMessage(LOG_ERROR_LEVEL, "CMPSC311 error seek failed [%s, pos=%d], aborting",
                         operation.objname, operation.pos);
                     return (-1);
@@ -315,9 +421,66 @@ int simulateLionCloud(char* wload)
             return (-1);
         }
 
+        /* Dump the cache statistics every so often */
+        ops++;
+        if ((statsinterval > 0) && (operation.op < WL_EOF) && (ops % statsinterval == 0)) {
+            dumpCacheStats(ops);
+        }
+
     } while (operation.op < WL_EOF);
 
     /* Log, close workload and delete the local file, return successfully  */
     closeCmpsc311Workload(&state);
     return (0);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dumpCacheStats
+// Description  : Log the cache statistics so far, with the hit ratio over the whole run and
+//                over the operations since the last dump, by device and by file
+//
+// Inputs       : ops - the number of workload operations processed
+// Outputs      : none
+
+void dumpCacheStats(int ops)
+{
+    /* Local variables, the statistics are too big for the stack */
+    static LcCacheStats now, last;
+    LcCacheCounters *c, *l;
+    uint64_t accesses, hits;
+
+    /* Nothing to report until the first open starts the cache */
+    if (lcloud_cachestats(&now) != 0) {
+        return;
+    }
+
+    /* Log the totals, then each device and file used since the last dump */
+    accesses = now.total.hits + now.total.misses;
+    hits = now.total.hits - last.total.hits;
+    logMessage(LOG_OUTPUT_LEVEL, "CACHE STATS AT OP %d: %llu ACCESSES, HIT RATIO %.2f (LAST %d OPS %.2f), %d/%d BLOCKS USED, "
+        "%llu EVICTIONS, %llu FLUSHES, %llu BYTES SAVED, LOOKUP P50 %.0f NS, P99 %.0f NS", ops,
+        (unsigned long long)accesses, (accesses > 0) ? (100.0 * now.total.hits / accesses) : 0.0, statsinterval,
+        (hits + now.total.misses - last.total.misses > 0) ? (100.0 * hits / (hits + now.total.misses - last.total.misses)) : 0.0,
+        now.used, now.blocks, (unsigned long long)now.total.evictions, (unsigned long long)now.total.flushes,
+        (unsigned long long)now.total.bytessaved, lcloud_cachelatency(&now, 0.50), lcloud_cachelatency(&now, 0.99));
+    for (int d = 0; d < LC_CACHE_STATDEVICES; d++) {
+        c = &now.device[d];
+        l = &last.device[d];
+        if (c->hits + c->misses > l->hits + l->misses) {
+            logMessage(LOG_OUTPUT_LEVEL, "    DEVICE %d: HIT RATIO %.2f (LAST %d OPS %.2f), %llu EVICTIONS", d,
+                100.0 * c->hits / (c->hits + c->misses), statsinterval,
+                100.0 * (c->hits - l->hits) / (c->hits + c->misses - l->hits - l->misses), (unsigned long long)c->evictions);
+        }
+    }
+    for (int f = 0; f < LC_CACHE_STATFILES; f++) {
+        c = &now.file[f];
+        l = &last.file[f];
+        if (c->hits + c->misses > l->hits + l->misses) {
+            logMessage(LOG_OUTPUT_LEVEL, "    FILE %d: HIT RATIO %.2f (LAST %d OPS %.2f), %llu INSERTIONS", f,
+                100.0 * c->hits / (c->hits + c->misses), statsinterval,
+                100.0 * (c->hits - l->hits) / (c->hits + c->misses - l->hits - l->misses), (unsigned long long)c->insertions);
+        }
+    }
+    last = now;
+}